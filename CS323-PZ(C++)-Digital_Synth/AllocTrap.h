@@ -0,0 +1,135 @@
+#pragma once
+
+// Debug aid: build with SYNTH_ALLOC_TRAP defined and any heap allocation made while an AllocTrapScope is
+// alive on the current thread prints a stack trace and aborts. The render callbacks open a scope around
+// each block, so this catches anything that allocates on the audio thread. Without the define the scope
+// compiles to nothing. The operator new replacements mean this may only be included by one translation unit.
+
+#ifdef SYNTH_ALLOC_TRAP
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <malloc.h>
+
+#include <Windows.h>
+#include <DbgHelp.h>
+#pragma comment(lib, "dbghelp.lib")
+
+#ifdef _DEBUG
+#include <crtdbg.h>
+#endif
+
+namespace synthesizer {
+
+	static thread_local int allocTrapDepth = 0;
+
+	static void AllocTrapFire(size_t size) {
+		// Disarm first, symbol lookup and printing may allocate themselves
+		allocTrapDepth = 0;
+		fprintf(stderr, "Allocation of %zu bytes on the audio thread\n", size);
+
+		void* frames[32];
+		unsigned short count = CaptureStackBackTrace(2, 32, frames, NULL);
+
+		HANDLE process = GetCurrentProcess();
+		SymInitialize(process, NULL, TRUE);
+
+		char storage[sizeof(SYMBOL_INFO) + 256];
+		SYMBOL_INFO* symbol = (SYMBOL_INFO*)storage;
+		for (unsigned short i = 0; i < count; i++) {
+			symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+			symbol->MaxNameLen = 255;
+			if (SymFromAddr(process, (DWORD64)frames[i], 0, symbol))
+				fprintf(stderr, "  %2u: %s\n", i, symbol->Name);
+			else
+				fprintf(stderr, "  %2u: %p\n", i, frames[i]);
+		}
+
+		fflush(stderr);
+		abort();
+	}
+
+	static void* AllocTrapAllocate(size_t size) {
+		if (allocTrapDepth > 0)
+			AllocTrapFire(size);
+
+		void* p = malloc(size == 0 ? 1 : size);
+		if (p == nullptr)
+			throw std::bad_alloc();
+		return p;
+	}
+
+	static void* AllocTrapAllocateNoThrow(size_t size) noexcept {
+		if (allocTrapDepth > 0)
+			AllocTrapFire(size);
+
+		return malloc(size == 0 ? 1 : size);
+	}
+
+	static void* AllocTrapAllocateAligned(size_t size, size_t alignment) noexcept {
+		if (allocTrapDepth > 0)
+			AllocTrapFire(size);
+
+		return _aligned_malloc(size == 0 ? 1 : size, alignment);
+	}
+
+#ifdef _DEBUG
+	// The debug CRT reports every malloc / realloc, which also catches C allocations that bypass operator new
+	static int AllocTrapCrtHook(int allocType, void* userData, size_t size, int blockType, long requestNumber, const unsigned char* fileName, int lineNumber) {
+		if (allocTrapDepth > 0 && allocType != _HOOK_FREE)
+			AllocTrapFire(size);
+		return TRUE;
+	}
+
+	static struct AllocTrapCrtInstaller {
+		AllocTrapCrtInstaller() { _CrtSetAllocHook(AllocTrapCrtHook); }
+	} allocTrapCrtInstaller;
+#endif
+
+	struct AllocTrapScope {
+		AllocTrapScope() { allocTrapDepth++; }
+		~AllocTrapScope() { if (allocTrapDepth > 0) allocTrapDepth--; }
+	};
+}
+
+void* operator new(size_t size) { return synthesizer::AllocTrapAllocate(size); }
+void* operator new[](size_t size) { return synthesizer::AllocTrapAllocate(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return synthesizer::AllocTrapAllocateNoThrow(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return synthesizer::AllocTrapAllocateNoThrow(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+// Over-aligned types go through these from C++17 on; they pair with _aligned_free, not free
+#ifdef __cpp_aligned_new
+void* operator new(size_t size, std::align_val_t alignment) {
+	void* p = synthesizer::AllocTrapAllocateAligned(size, (size_t)alignment);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+	void* p = synthesizer::AllocTrapAllocateAligned(size, (size_t)alignment);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return synthesizer::AllocTrapAllocateAligned(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return synthesizer::AllocTrapAllocateAligned(size, (size_t)alignment); }
+void operator delete(void* p, std::align_val_t) noexcept { _aligned_free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { _aligned_free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { _aligned_free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { _aligned_free(p); }
+#endif
+
+#else
+
+namespace synthesizer {
+
+	struct AllocTrapScope {
+	};
+}
+
+#endif
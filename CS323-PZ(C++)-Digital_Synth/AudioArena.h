@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <algorithm>
+using namespace std;
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	********************************************** AUDIO ARENA *****************************************************
+	****************************************************************************************************************/
+
+	// Fixed block of memory carved up at startup. Everything the audio thread touches lives in here, so
+	// nothing on the render path ever reaches the heap. Allocation is a pointer bump; there is no free.
+	class AudioArena {
+
+	public:
+		AudioArena(size_t capacity) {
+			m_capacity = capacity;
+			m_used = 0;
+			m_memory = new unsigned char[capacity];
+		}
+
+		~AudioArena() {
+			delete[] m_memory;
+		}
+
+		AudioArena(const AudioArena&) = delete;
+		AudioArena& operator=(const AudioArena&) = delete;
+
+		// Returns nullptr once the arena is exhausted
+		void* Allocate(size_t size, size_t alignment = alignof(max_align_t)) {
+			uintptr_t base = (uintptr_t)m_memory;
+			uintptr_t start = (base + m_used + alignment - 1) & ~(uintptr_t)(alignment - 1);
+			if (start + size > base + m_capacity)
+				return nullptr;
+			m_used = start + size - base;
+			return (void*)start;
+		}
+
+		template<class T>
+		T* AllocateArray(size_t count) {
+			T* items = (T*)Allocate(sizeof(T) * count, alignof(T));
+			if (items != nullptr)
+				for (size_t i = 0; i < count; i++)
+					new (&items[i]) T();
+			return items;
+		}
+
+		void* Data() const { return m_memory; }
+		size_t Used() const { return m_used; }
+		size_t Capacity() const { return m_capacity; }
+
+	private:
+		unsigned char* m_memory;
+		size_t m_capacity;
+		size_t m_used;
+	};
+
+	// Standard allocator for buffers the mixing loops stream through, aligned for full width vector loads and
+	// to cache lines. It sits on operator new, so the allocation trap still sees it.
+	template<class T, size_t Alignment = 64>
+	struct AlignedAllocator {
+		typedef T value_type;
+
+		template<class U>
+		struct rebind {
+			typedef AlignedAllocator<U, Alignment> other;
+		};
+
+		AlignedAllocator() {}
+
+		template<class U>
+		AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+		// The block operator new returned is kept just below the aligned start
+		T* allocate(size_t count) {
+			unsigned char* block = (unsigned char*)::operator new(count * sizeof(T) + Alignment + sizeof(void*));
+			uintptr_t start = ((uintptr_t)block + sizeof(void*) + Alignment - 1) & ~(uintptr_t)(Alignment - 1);
+			((void**)start)[-1] = block;
+			return (T*)start;
+		}
+
+		void deallocate(T* items, size_t) {
+			if (items != nullptr)
+				::operator delete(((void**)items)[-1]);
+		}
+
+		template<class U>
+		bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+
+		template<class U>
+		bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+	};
+
+	// Vector-like list over arena storage with a capacity fixed at startup. push_back / emplace_back drop the
+	// item and return false when full instead of growing.
+	template<class T>
+	class FixedList {
+
+	public:
+		typedef T* iterator;
+		typedef const T* const_iterator;
+
+		FixedList() {
+			m_items = nullptr;
+			m_size = 0;
+			m_capacity = 0;
+		}
+
+		bool Reserve(AudioArena& arena, size_t capacity) {
+			m_items = arena.AllocateArray<T>(capacity);
+			m_size = 0;
+			m_capacity = m_items != nullptr ? capacity : 0;
+			return m_items != nullptr;
+		}
+
+		bool push_back(const T& item) {
+			if (m_size == m_capacity)
+				return false;
+			m_items[m_size++] = item;
+			return true;
+		}
+
+		bool emplace_back(const T& item) {
+			return push_back(item);
+		}
+
+		iterator erase(iterator first, iterator last) {
+			iterator out = move(last, end(), first);
+			m_size = out - m_items;
+			return first;
+		}
+
+		void clear() { m_size = 0; }
+
+		iterator begin() { return m_items; }
+		iterator end() { return m_items + m_size; }
+		const_iterator begin() const { return m_items; }
+		const_iterator end() const { return m_items + m_size; }
+
+		T& operator[](size_t i) { return m_items[i]; }
+		const T& operator[](size_t i) const { return m_items[i]; }
+
+		size_t size() const { return m_size; }
+		size_t capacity() const { return m_capacity; }
+		bool empty() const { return m_size == 0; }
+
+	private:
+		T* m_items;
+		size_t m_size;
+		size_t m_capacity;
+	};
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+using namespace std;
+
+#ifndef I_FREQ_TYPE
+#define I_FREQ_TYPE double
+#endif
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	*********************************************** AUDIO TAP ******************************************************
+	****************************************************************************************************************/
+
+	// Recent output blocks for whoever wants to look at them. The render thread copies each block in and never
+	// waits; a reader that falls more than TAP_BLOCKS behind loses the oldest blocks, never the render.
+
+	const unsigned int TAP_BLOCKS = 64;
+
+	struct TapBlock {
+		atomic<unsigned long long> sequence; // odd while being written, 2 * (index + 1) once block 'index' is in
+		unsigned int frames;
+		unsigned int channels;
+		vector<I_FREQ_TYPE> samples;
+
+		TapBlock() : sequence(0) {
+			frames = 0;
+			channels = 1;
+		}
+	};
+
+	class AudioTap {
+
+	public:
+		// maxSamples: frames * channels of the largest block that will be written, longer blocks are cut
+		AudioTap(unsigned int maxSamples = 4096) : m_head(0), m_blocks(TAP_BLOCKS) {
+			for (auto& block : m_blocks)
+				block.samples.assign(maxSamples, 0.0);
+		}
+
+		AudioTap(const AudioTap&) = delete;
+		AudioTap& operator=(const AudioTap&) = delete;
+
+		// Render thread: one copy and three stores, before the block is clipped to the device range
+		void Write(const I_FREQ_TYPE* samples, unsigned int frames, unsigned int channels) {
+			unsigned long long head = m_head.load(memory_order_relaxed);
+			TapBlock& block = m_blocks[head % TAP_BLOCKS];
+			unsigned int count = min(frames * channels, (unsigned int)block.samples.size());
+
+			block.sequence.store(2 * head + 1, memory_order_relaxed);
+			atomic_thread_fence(memory_order_release);
+			memcpy(block.samples.data(), samples, count * sizeof(I_FREQ_TYPE));
+			block.frames = count / channels;
+			block.channels = channels;
+			block.sequence.store(2 * head + 2, memory_order_release);
+			m_head.store(head + 1, memory_order_release);
+		}
+
+		// Blocks written so far
+		unsigned long long Head() const {
+			return m_head.load(memory_order_acquire);
+		}
+
+		// Any other thread: hands consume(samples, frames, channels) every block from 'position' on, then moves
+		// position to the head. The block is copied into 'scratch' first and dropped if the writer came round
+		// while it was copied. Returns the number of blocks lost.
+		template<class Consumer>
+		unsigned long long Read(unsigned long long& position, vector<I_FREQ_TYPE>& scratch, Consumer consume) const {
+			unsigned long long head = Head();
+			unsigned long long lost = 0;
+
+			if (head - position > TAP_BLOCKS) {
+				lost += head - position - TAP_BLOCKS;
+				position = head - TAP_BLOCKS;
+			}
+
+			for (; position < head; position++) {
+				const TapBlock& block = m_blocks[position % TAP_BLOCKS];
+				unsigned long long sequence = block.sequence.load(memory_order_acquire);
+				if (sequence != 2 * position + 2) {
+					lost++;
+					continue;
+				}
+
+				unsigned int frames = block.frames;
+				unsigned int channels = block.channels;
+				scratch.resize(min((size_t)frames * channels, block.samples.size()));
+				memcpy(scratch.data(), block.samples.data(), scratch.size() * sizeof(I_FREQ_TYPE));
+
+				atomic_thread_fence(memory_order_acquire);
+				if (block.sequence.load(memory_order_relaxed) != sequence) {
+					lost++;
+					continue;
+				}
+
+				consume(scratch.data(), (unsigned int)scratch.size() / max(channels, 1u), channels);
+			}
+
+			return lost;
+		}
+
+	private:
+		atomic<unsigned long long> m_head;
+		vector<TapBlock> m_blocks;
+	};
+}
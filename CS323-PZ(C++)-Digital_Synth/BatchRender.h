@@ -0,0 +1,252 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+using namespace std;
+
+#include "SynthEngine.h"
+#include "Song.h"
+#include "Midi.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	********************************************* BATCH RENDER *****************************************************
+	****************************************************************************************************************/
+
+	// Streams 16 bit PCM to a WAV file, the header sizes are patched in on Close
+	class WavWriter {
+
+	public:
+		WavWriter() {
+			m_frames = 0;
+			m_channels = 1;
+		}
+
+		~WavWriter() {
+			Close();
+		}
+
+		bool Open(const string& path, unsigned int sampleRate, unsigned int channels = 1) {
+			m_file.open(path, ios::binary);
+			if (!m_file.is_open())
+				return false;
+
+			m_channels = channels;
+			m_frames = 0;
+
+			unsigned int byteRate = sampleRate * channels * 2;
+			unsigned short blockAlign = (unsigned short)(channels * 2);
+			unsigned short bits = 16;
+			unsigned short format = 1;
+			unsigned short channelCount = (unsigned short)channels;
+			unsigned int formatSize = 16;
+			unsigned int zero = 0;
+
+			m_file.write("RIFF", 4);
+			m_file.write((const char*)&zero, 4);
+			m_file.write("WAVEfmt ", 8);
+			m_file.write((const char*)&formatSize, 4);
+			m_file.write((const char*)&format, 2);
+			m_file.write((const char*)&channelCount, 2);
+			m_file.write((const char*)&sampleRate, 4);
+			m_file.write((const char*)&byteRate, 4);
+			m_file.write((const char*)&blockAlign, 2);
+			m_file.write((const char*)&bits, 2);
+			m_file.write("data", 4);
+			m_file.write((const char*)&zero, 4);
+			return m_file.good();
+		}
+
+		void Write(const I_FREQ_TYPE* samples, unsigned int frames) {
+			m_pcm.resize(frames * m_channels);
+			for (size_t i = 0; i < m_pcm.size(); i++) {
+				I_FREQ_TYPE s = max(-1.0, min(1.0, samples[i]));
+				m_pcm[i] = (short)(s * 32767.0);
+			}
+			m_file.write((const char*)m_pcm.data(), m_pcm.size() * sizeof(short));
+			m_frames += frames;
+		}
+
+		void Close() {
+			if (!m_file.is_open())
+				return;
+
+			unsigned int dataSize = (unsigned int)(m_frames * m_channels * 2);
+			unsigned int riffSize = 36 + dataSize;
+			m_file.seekp(4);
+			m_file.write((const char*)&riffSize, 4);
+			m_file.seekp(40);
+			m_file.write((const char*)&dataSize, 4);
+			m_file.close();
+		}
+
+	private:
+		ofstream m_file;
+		unsigned int m_channels;
+		unsigned long long m_frames;
+		vector<short> m_pcm;
+	};
+
+	struct BatchJob {
+		string input;
+		string output;
+		I_FREQ_TYPE seconds; // <= 0 renders a MIDI file to its end plus a tail
+	};
+
+	// Job list format, one job per line, '#' starts a comment:
+	//   <song or .mid file> <output.wav> [seconds]
+	bool LoadBatchJobs(const string& path, vector<BatchJob>& jobs) {
+		ifstream file(path);
+		if (!file.is_open())
+			return false;
+
+		string text;
+		while (getline(file, text)) {
+			size_t comment = text.find('#');
+			if (comment != string::npos)
+				text.erase(comment);
+
+			istringstream line(text);
+			BatchJob job;
+			job.seconds = 0.0;
+			if (!(line >> job.input))
+				continue;
+			if (!(line >> job.output))
+				return false;
+			line >> job.seconds;
+			jobs.push_back(job);
+		}
+		return true;
+	}
+
+	static bool EndsWith(const string& s, const string& suffix) {
+		return s.size() >= suffix.size() && equal(suffix.rbegin(), suffix.rend(), s.rbegin());
+	}
+
+	// Channel 10 goes to the drum kit by General MIDI note, everything else to the keyboard instrument
+	static BaseInstrument* MidiInstrument(SynthEngine& engine, const MidiEvent& e) {
+		if (e.channel != 9)
+			return engine.keyboardInstrument;
+		if (e.note == 35 || e.note == 36)
+			return &engine.kickDrum;
+		if (e.note == 38 || e.note == 40)
+			return &engine.snareDrum;
+		return &engine.hiHat;
+	}
+
+	// Renders one job on the calling thread with its own engine. Returns the rendered length in seconds, or
+	// a negative value when the job could not be loaded or written.
+	I_FREQ_TYPE RenderBatchJob(const BatchJob& job, unsigned int sampleRate) {
+		SynthEngine engine(sampleRate, 512, 0);
+		engine.SetDirectSampleReads(true);
+		engine.keyboardInstrument = engine.LoadInstrument("Patches/Supersaw.patch", engine.supersaw);
+
+		vector<MidiEvent> events;
+		bool midi = EndsWith(job.input, ".mid") || EndsWith(job.input, ".midi");
+		if (midi ? !LoadMidi(job.input, events) : !LoadSong(job.input, engine))
+			return -1.0;
+
+		vector<pair<BaseInstrument*, int>> hits;
+		for (const MidiEvent& e : events)
+			if (e.on && !e.control)
+				hits.push_back(make_pair(MidiInstrument(engine, e), e.note));
+		engine.CacheOneShots(hits);
+
+		I_FREQ_TYPE seconds = job.seconds;
+		if (seconds <= 0.0)
+			seconds = (events.empty() ? 0.0 : events.back().time) + 2.0;
+
+		WavWriter wav;
+		if (!wav.Open(job.output, sampleRate))
+			return -1.0;
+
+		unsigned long long total = (unsigned long long)(seconds * sampleRate);
+		unsigned long long rendered = 0;
+		size_t next = 0;
+		vector<I_FREQ_TYPE> block(engine.MaxFrames());
+
+		while (rendered < total) {
+			// Apply every MIDI event that is due, then render up to the next one so they land on their sample
+			while (next < events.size() && (unsigned long long)(events[next].time * sampleRate) <= rendered) {
+				const MidiEvent& e = events[next++];
+				if (e.control)
+					engine.parameters.ControlChange(e.note, e.velocity);
+				else if (e.on)
+					engine.NoteOn(MidiInstrument(engine, e), e.note, engine.Time(), e.velocity / 127.0);
+				else
+					engine.NoteOff(MidiInstrument(engine, e), e.note, engine.Time());
+			}
+
+			unsigned long long until = total;
+			if (next < events.size())
+				until = min(until, max(rendered + 1, (unsigned long long)(events[next].time * sampleRate)));
+
+			unsigned int frames = (unsigned int)min<unsigned long long>(until - rendered, block.size());
+			engine.RenderOffline(block.data(), frames);
+			wav.Write(block.data(), frames);
+			rendered += frames;
+		}
+
+		return (I_FREQ_TYPE)rendered / sampleRate;
+	}
+
+	// Renders every job in the list, one engine per worker thread, and reports throughput as rendered
+	// seconds per wall clock second. Returns the number of failed jobs.
+	int RunBatch(const string& jobFile, unsigned int threads = 0, unsigned int sampleRate = 44100) {
+		vector<BatchJob> jobs;
+		if (!LoadBatchJobs(jobFile, jobs)) {
+			cerr << jobFile << ": cannot read job list" << endl;
+			return -1;
+		}
+
+		if (threads == 0)
+			threads = max(1u, thread::hardware_concurrency());
+		threads = min(threads, (unsigned int)max<size_t>(1, jobs.size()));
+
+		atomic<size_t> nextJob(0);
+		atomic<int> failed(0);
+		mutex muxReport;
+		I_FREQ_TYPE renderedSeconds = 0.0;
+
+		auto start = chrono::high_resolution_clock::now();
+
+		auto worker = [&]() {
+			for (size_t j = nextJob++; j < jobs.size(); j = nextJob++) {
+				auto jobStart = chrono::high_resolution_clock::now();
+				I_FREQ_TYPE seconds = RenderBatchJob(jobs[j], sampleRate);
+				I_FREQ_TYPE wall = chrono::duration<I_FREQ_TYPE>(chrono::high_resolution_clock::now() - jobStart).count();
+
+				unique_lock<mutex> lm(muxReport);
+				if (seconds < 0.0) {
+					failed++;
+					cerr << jobs[j].input << ": render failed" << endl;
+				}
+				else {
+					renderedSeconds += seconds;
+					cout << jobs[j].output << ": " << seconds << " s in " << wall << " s (" << seconds / max(wall, 1e-9) << "x)" << endl;
+				}
+			}
+		};
+
+		vector<thread> workers;
+		for (unsigned int t = 0; t < threads; t++)
+			workers.push_back(thread(worker));
+		for (auto& t : workers)
+			t.join();
+
+		I_FREQ_TYPE wall = chrono::duration<I_FREQ_TYPE>(chrono::high_resolution_clock::now() - start).count();
+		cout << jobs.size() - failed << "/" << jobs.size() << " jobs, " << renderedSeconds << " s rendered in " << wall << " s on "
+			<< threads << " threads: " << renderedSeconds / max(wall, 1e-9) << " rendered seconds per wall second" << endl;
+
+		return failed;
+	}
+}
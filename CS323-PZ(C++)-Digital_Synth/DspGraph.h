@@ -0,0 +1,559 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+using namespace std;
+
+#include "Synthesizer.h"
+#include "AllocTrap.h"
+#include "RealtimeProfile.h"
+#include "Trace.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	********************************************** DSP GRAPH *******************************************************
+	****************************************************************************************************************/
+
+	const int MAX_NODE_INPUTS = 8;
+	const int GRAPH_WORKER_SPIN_MS = 15;  // a worker keeps polling this long after its last step, a little over a 512 frame block
+	const int GRAPH_WORKER_PARK_MS = 5;   // a parked worker checks for work this often even without a wake up
+
+	struct DspContext {
+		I_FREQ_TYPE time;
+		I_FREQ_TYPE timeStep;
+		unsigned int frames;
+	};
+
+	struct DspNode {
+		wstring name;
+
+		virtual ~DspNode() {}
+
+		// Writes ctx.frames samples to output. Inputs are the outputs of the connected nodes, in connection order.
+		virtual void Process(const DspContext& ctx, const I_FREQ_TYPE* const* inputs, int inputCount, I_FREQ_TYPE* output) = 0;
+	};
+
+	struct OscillatorNode : public DspNode {
+		I_FREQ_TYPE hertz;
+		int waveform;
+		I_FREQ_TYPE gain;
+
+		OscillatorNode(I_FREQ_TYPE hertz = 440.0, int waveform = SINE_WAVE, I_FREQ_TYPE gain = 1.0) {
+			this->hertz = hertz;
+			this->waveform = waveform;
+			this->gain = gain;
+			name = L"Oscillator";
+		}
+
+		virtual void Process(const DspContext& ctx, const I_FREQ_TYPE* const* inputs, int inputCount, I_FREQ_TYPE* output) {
+			for (unsigned int i = 0; i < ctx.frames; i++)
+				output[i] = gain * Oscillate(ctx.time + i * ctx.timeStep, hertz, waveform);
+		}
+	};
+
+	// Gates its summed inputs with an ADSR driven by Trigger / Release from any thread
+	struct EnvelopeNode : public DspNode {
+		EnvelopeADSR envelope;
+		atomic<I_FREQ_TYPE> timeOn;
+		atomic<I_FREQ_TYPE> timeOff;
+
+		EnvelopeNode() {
+			timeOn = 0.0;
+			timeOff = 0.0;
+			name = L"Envelope";
+		}
+
+		void Trigger(I_FREQ_TYPE time) { timeOn = time; }
+		void Release(I_FREQ_TYPE time) { timeOff = time; }
+
+		virtual void Process(const DspContext& ctx, const I_FREQ_TYPE* const* inputs, int inputCount, I_FREQ_TYPE* output) {
+			I_FREQ_TYPE on = timeOn;
+			I_FREQ_TYPE off = timeOff;
+
+			for (unsigned int i = 0; i < ctx.frames; i++) {
+				I_FREQ_TYPE sum = 0.0;
+				for (int k = 0; k < inputCount; k++)
+					sum += inputs[k][i];
+				output[i] = sum * envelope.amplitude(ctx.time + i * ctx.timeStep, on, off);
+			}
+		}
+	};
+
+	// One pole low pass over the summed inputs
+	struct FilterNode : public DspNode {
+		I_FREQ_TYPE cutoff;
+		I_FREQ_TYPE state;
+
+		FilterNode(I_FREQ_TYPE cutoff = 1000.0) {
+			this->cutoff = cutoff;
+			state = 0.0;
+			name = L"Filter";
+		}
+
+		virtual void Process(const DspContext& ctx, const I_FREQ_TYPE* const* inputs, int inputCount, I_FREQ_TYPE* output) {
+			I_FREQ_TYPE coefficient = 1.0 - exp(-ConvertToHz(cutoff) * ctx.timeStep);
+
+			for (unsigned int i = 0; i < ctx.frames; i++) {
+				I_FREQ_TYPE sum = 0.0;
+				for (int k = 0; k < inputCount; k++)
+					sum += inputs[k][i];
+				state += coefficient * (sum - state);
+				output[i] = state;
+			}
+		}
+	};
+
+	// Sums its inputs with a gain per input; inputs without an entry in gains pass at unity
+	struct MixerNode : public DspNode {
+		vector<I_FREQ_TYPE> gains;
+		I_FREQ_TYPE master;
+
+		MixerNode(I_FREQ_TYPE master = 1.0) {
+			this->master = master;
+			name = L"Mixer";
+		}
+
+		virtual void Process(const DspContext& ctx, const I_FREQ_TYPE* const* inputs, int inputCount, I_FREQ_TYPE* output) {
+			fill(output, output + ctx.frames, 0.0);
+
+			for (int k = 0; k < inputCount; k++) {
+				I_FREQ_TYPE gain = master * (k < (int)gains.size() ? gains[k] : 1.0);
+				for (unsigned int i = 0; i < ctx.frames; i++)
+					output[i] += gain * inputs[k][i];
+			}
+		}
+	};
+
+	// Unity sum point that other nodes can tap, e.g. as a sidechain key
+	struct BusNode : public MixerNode {
+		BusNode() {
+			name = L"Bus";
+		}
+	};
+
+	// Input 0 is the signal, input 1 the sidechain key. The signal is ducked by the key's envelope.
+	struct DuckerNode : public DspNode {
+		I_FREQ_TYPE depth;
+		I_FREQ_TYPE releaseTime;
+		I_FREQ_TYPE follower;
+
+		DuckerNode(I_FREQ_TYPE depth = 0.8, I_FREQ_TYPE releaseTime = 0.15) {
+			this->depth = depth;
+			this->releaseTime = releaseTime;
+			follower = 0.0;
+			name = L"Ducker";
+		}
+
+		virtual void Process(const DspContext& ctx, const I_FREQ_TYPE* const* inputs, int inputCount, I_FREQ_TYPE* output) {
+			if (inputCount == 0) {
+				fill(output, output + ctx.frames, 0.0);
+				return;
+			}
+
+			I_FREQ_TYPE decay = exp(-ctx.timeStep / releaseTime);
+			for (unsigned int i = 0; i < ctx.frames; i++) {
+				if (inputCount > 1)
+					follower = max(fabs(inputs[1][i]), follower * decay);
+				output[i] = inputs[0][i] * (1.0 - depth * min(follower, 1.0));
+			}
+		}
+	};
+
+	// Source node that hands the block to a callback, used to bring the voice mix into the graph
+	typedef void(*DspSourceFunction)(void* userData, const DspContext& ctx, I_FREQ_TYPE* output);
+
+	struct SourceNode : public DspNode {
+		DspSourceFunction function;
+		void* userData;
+
+		SourceNode(DspSourceFunction function, void* userData) {
+			this->function = function;
+			this->userData = userData;
+			name = L"Source";
+		}
+
+		virtual void Process(const DspContext& ctx, const I_FREQ_TYPE* const* inputs, int inputCount, I_FREQ_TYPE* output) {
+			function(userData, ctx, output);
+		}
+	};
+
+	struct DspStep {
+		DspNode* node;
+		const I_FREQ_TYPE* inputs[MAX_NODE_INPUTS];
+		int inputCount;
+		I_FREQ_TYPE* output;
+	};
+
+	// Immutable schedule produced by DspGraph::Compile. Steps are sorted by level; every step of a level
+	// only reads buffers written by earlier levels, so a level can be spread over several threads.
+	struct CompiledGraph {
+		vector<shared_ptr<DspNode>> nodes;
+		vector<DspStep> steps;
+		vector<int> levelStart;
+		vector<I_FREQ_TYPE> buffers;
+		unsigned int maxFrames;
+		int bufferCount;
+		const I_FREQ_TYPE* output;
+	};
+
+	// Editable node graph, owned by the UI thread. Compile it and hand the result to a DspGraphRunner.
+	struct DspGraph {
+		vector<shared_ptr<DspNode>> nodes;
+		vector<vector<int>> inputs;
+		int outputNode;
+
+		DspGraph() {
+			outputNode = -1;
+		}
+
+		int AddNode(shared_ptr<DspNode> node) {
+			nodes.push_back(node);
+			inputs.push_back(vector<int>());
+			return (int)nodes.size() - 1;
+		}
+
+		bool Connect(int from, int to) {
+			if (from < 0 || to < 0 || from >= (int)nodes.size() || to >= (int)nodes.size())
+				return false;
+			if (inputs[to].size() >= MAX_NODE_INPUTS)
+				return false;
+			inputs[to].push_back(from);
+			return true;
+		}
+
+		void SetOutput(int node) {
+			outputNode = node;
+		}
+
+		// Sorts the nodes feeding the output into levels and assigns buffers, reusing a buffer as soon as
+		// the last level reading it has run. Returns nullptr if the graph has a cycle or no output.
+		CompiledGraph* Compile(unsigned int maxFrames) const {
+			if (outputNode < 0 || outputNode >= (int)nodes.size())
+				return nullptr;
+
+			int count = (int)nodes.size();
+
+			// Only nodes that reach the output are scheduled
+			vector<bool> used(count, false);
+			vector<int> stack(1, outputNode);
+			used[outputNode] = true;
+			while (!stack.empty()) {
+				int n = stack.back();
+				stack.pop_back();
+				for (int i : inputs[n])
+					if (!used[i]) {
+						used[i] = true;
+						stack.push_back(i);
+					}
+			}
+
+			// Kahn's algorithm, tracking the longest path from a source as the level
+			vector<vector<int>> consumers(count);
+			vector<int> pending(count, 0);
+			for (int n = 0; n < count; n++) {
+				if (!used[n]) continue;
+				for (int i : inputs[n]) {
+					consumers[i].push_back(n);
+					pending[n]++;
+				}
+			}
+
+			vector<int> level(count, 0);
+			vector<int> order;
+			for (int n = 0; n < count; n++)
+				if (used[n] && pending[n] == 0)
+					order.push_back(n);
+
+			for (size_t k = 0; k < order.size(); k++) {
+				int n = order[k];
+				for (int c : consumers[n]) {
+					level[c] = max(level[c], level[n] + 1);
+					if (--pending[c] == 0)
+						order.push_back(c);
+				}
+			}
+
+			int usedCount = (int)count_if(used.begin(), used.end(), [](bool b) { return b; });
+			if ((int)order.size() != usedCount)
+				return nullptr;
+
+			stable_sort(order.begin(), order.end(), [&level](int a, int b) { return level[a] < level[b]; });
+
+			// A node's buffer is live until the highest level that reads it. The output stays live.
+			int levelCount = level[order.back()] + 1;
+			vector<int> lastUse(count, -1);
+			for (int n : order)
+				for (int c : consumers[n])
+					lastUse[n] = max(lastUse[n], level[c]);
+			lastUse[outputNode] = levelCount;
+
+			vector<int> bufferOf(count, -1);
+			vector<int> freeBuffers;
+			int bufferCount = 0;
+			size_t k = 0;
+			for (int l = 0; l < levelCount; l++) {
+				for (; k < order.size() && level[order[k]] == l; k++) {
+					if (freeBuffers.empty()) {
+						bufferOf[order[k]] = bufferCount++;
+					}
+					else {
+						bufferOf[order[k]] = freeBuffers.back();
+						freeBuffers.pop_back();
+					}
+				}
+
+				// Buffers read for the last time at this level are free from the next level on
+				for (size_t j = 0; j < k; j++) {
+					int n = order[j];
+					if (lastUse[n] == l)
+						freeBuffers.push_back(bufferOf[n]);
+				}
+			}
+
+			CompiledGraph* graph = new CompiledGraph();
+			graph->maxFrames = maxFrames;
+			graph->bufferCount = bufferCount;
+			graph->buffers.assign((size_t)bufferCount * maxFrames, 0.0);
+			graph->nodes = nodes;
+
+			int currentLevel = -1;
+			for (int n : order) {
+				if (level[n] != currentLevel) {
+					currentLevel = level[n];
+					graph->levelStart.push_back((int)graph->steps.size());
+				}
+
+				DspStep step;
+				step.node = nodes[n].get();
+				step.inputCount = (int)inputs[n].size();
+				for (int i = 0; i < step.inputCount; i++)
+					step.inputs[i] = graph->buffers.data() + (size_t)bufferOf[inputs[n][i]] * maxFrames;
+				step.output = graph->buffers.data() + (size_t)bufferOf[n] * maxFrames;
+				graph->steps.push_back(step);
+			}
+			graph->levelStart.push_back((int)graph->steps.size());
+			graph->output = graph->buffers.data() + (size_t)bufferOf[outputNode] * maxFrames;
+
+			return graph;
+		}
+	};
+
+	// Executes the current CompiledGraph once per block on the audio thread, spreading wide levels over a
+	// few worker threads. The audio thread publishes a level with one atomic store and claims steps itself,
+	// so a worker that wakes late only costs parallelism, never correctness; once nothing is left to claim
+	// it yields until the steps workers are still running finish. It never takes a lock. Workers poll while
+	// audio runs and park on a condition variable once it stops, the audio thread only notifies parked ones.
+	class DspGraphRunner {
+
+	public:
+		// A negative worker count picks one from the core count
+		DspGraphRunner(int workers = -1) {
+			m_current = nullptr;
+			m_pending = nullptr;
+			m_retired = nullptr;
+			m_work = 0;
+			m_remaining = 0;
+			m_generation = 0;
+			m_profileSerial = 0;
+			m_profiled = 0;
+			m_parked = 0;
+			m_running = true;
+
+			if (workers < 0)
+				workers = (int)min(3u, max(1u, thread::hardware_concurrency()) - 1);
+
+			for (int i = 0; i < workers; i++)
+				m_workers.push_back(thread(&DspGraphRunner::WorkerThread, this));
+		}
+
+		~DspGraphRunner() {
+			{
+				lock_guard<mutex> lm(m_muxWake);
+				m_running = false;
+			}
+			m_wake.notify_all();
+			for (auto& t : m_workers)
+				t.join();
+
+			delete m_current;
+			delete m_pending.exchange(nullptr);
+			delete m_retired.exchange(nullptr);
+		}
+
+		// Called from the editing thread. The graph is picked up at the start of the next block.
+		void Submit(CompiledGraph* graph) {
+			CollectGarbage();
+			delete m_pending.exchange(graph);
+		}
+
+		// Frees the graph the audio thread swapped out. Call from the editing thread.
+		void CollectGarbage() {
+			delete m_retired.exchange(nullptr);
+		}
+
+		// The workers share the audio thread's deadline, so they apply the render thread's profile to themselves
+		// when they next wake. The affinity is left out, pinning them to the render thread's core would serialise
+		// the levels again.
+		void SetRealtimeProfile(const RealtimeProfile& profile) {
+			{
+				lock_guard<mutex> lm(m_muxWake);
+				m_profile = profile;
+				m_profile.affinityMask = 0;
+				m_profile.lockMemory = false;
+				m_profiled = 0;
+				m_profileSerial++;
+			}
+			m_wake.notify_all();
+		}
+
+		int WorkerCount() const {
+			return (int)m_workers.size();
+		}
+
+		// Workers that have applied the last profile
+		int WorkersProfiled() const {
+			return m_profiled;
+		}
+
+		void Process(const DspContext& ctx, I_FREQ_TYPE* output) {
+			// Swap only when the previous graph has been collected, so the audio thread never frees memory
+			if (m_pending.load() != nullptr && m_retired.load() == nullptr) {
+				CompiledGraph* next = m_pending.exchange(nullptr);
+				if (next != nullptr) {
+					m_retired = m_current;
+					m_current = next;
+				}
+			}
+
+			if (m_current == nullptr || ctx.frames > m_current->maxFrames) {
+				fill(output, output + ctx.frames, 0.0);
+				return;
+			}
+
+			m_context = ctx;
+
+			for (size_t l = 0; l + 1 < m_current->levelStart.size(); l++) {
+				int begin = m_current->levelStart[l];
+				int end = m_current->levelStart[l + 1];
+
+				if (end - begin == 1 || m_workers.empty()) {
+					for (int s = begin; s < end; s++)
+						RunStep(m_current->steps[s]);
+					continue;
+				}
+
+				m_remaining = end - begin;
+				m_generation = (m_generation + 1) & 0xFFFF;
+				m_work = Pack(m_generation, begin, end);
+				if (m_parked.load() > 0)
+					m_wake.notify_all();
+
+				DoWork(m_generation);
+				if (m_remaining.load() != 0) {
+					TraceScope trace("graph wait");
+					while (m_remaining.load() != 0)
+						this_thread::yield();
+				}
+			}
+
+			copy(m_current->output, m_current->output + ctx.frames, output);
+		}
+
+	private:
+		// Generation (16 bits), next step (24 bits) and end step (24 bits) share one word so a claim can
+		// never land on a level other than the one the claimer was woken for
+		static unsigned long long Pack(unsigned long long generation, unsigned long long next, unsigned long long end) {
+			return (generation << 48) | (next << 24) | end;
+		}
+
+		void RunStep(const DspStep& step) {
+			TraceScope trace("graph step");
+			step.node->Process(m_context, step.inputs, step.inputCount, step.output);
+		}
+
+		void DoWork(unsigned long long generation) {
+			while (true) {
+				unsigned long long work = m_work.load();
+				unsigned long long next = (work >> 24) & 0xFFFFFF;
+				unsigned long long end = work & 0xFFFFFF;
+
+				if ((work >> 48) != generation || next >= end)
+					return;
+
+				if (m_work.compare_exchange_weak(work, Pack(generation, next + 1, end))) {
+					RunStep(m_current->steps[next]);
+					m_remaining--;
+				}
+			}
+		}
+
+		void WorkerThread() {
+			TraceThread("graph worker");
+			unsigned long long seen = 0;
+			unsigned int profileSeen = 0;
+			auto lastWork = chrono::steady_clock::now();
+
+			while (m_running) {
+				if (m_profileSerial.load() != profileSeen) {
+					RealtimeProfile profile;
+					{
+						lock_guard<mutex> lm(m_muxWake);
+						profileSeen = m_profileSerial;
+						profile = m_profile;
+					}
+					ApplyThreadProfile(profile);
+					m_profiled++;
+				}
+
+				unsigned long long generation = m_work.load() >> 48;
+				if (generation != seen) {
+					AllocTrapScope trap;
+					seen = generation;
+					DoWork(generation);
+					lastWork = chrono::steady_clock::now();
+					continue;
+				}
+
+				if (chrono::steady_clock::now() - lastWork < chrono::milliseconds(GRAPH_WORKER_SPIN_MS)) {
+					this_thread::yield();
+					continue;
+				}
+
+				// The audio thread notifies without the lock, so a wake up can slip past; the timeout catches it
+				unique_lock<mutex> lm(m_muxWake);
+				m_parked++;
+				m_wake.wait_for(lm, chrono::milliseconds(GRAPH_WORKER_PARK_MS), [this, seen, profileSeen] {
+					return !m_running || (m_work.load() >> 48) != seen || m_profileSerial.load() != profileSeen;
+				});
+				m_parked--;
+			}
+		}
+
+		CompiledGraph* m_current;
+		atomic<CompiledGraph*> m_pending;
+		atomic<CompiledGraph*> m_retired;
+		DspContext m_context;
+
+		vector<thread> m_workers;
+		atomic<bool> m_running;
+		atomic<unsigned long long> m_work;
+		atomic<int> m_remaining;
+		unsigned long long m_generation;
+		mutex m_muxWake;
+		condition_variable m_wake;
+		atomic<int> m_parked;
+
+		RealtimeProfile m_profile;
+		atomic<unsigned int> m_profileSerial;
+		atomic<int> m_profiled;
+	};
+}
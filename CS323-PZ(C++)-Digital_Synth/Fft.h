@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cmath>
+#include <complex>
+#include <vector>
+using namespace std;
+
+#include "OscilatorThread.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	************************************************** FFT *********************************************************
+	****************************************************************************************************************/
+
+	// In place iterative radix-2 FFT. The size must be a power of two.
+	void Fft(vector<complex<I_FREQ_TYPE>>& data) {
+		size_t n = data.size();
+
+		for (size_t i = 1, j = 0; i < n; i++) {
+			size_t bit = n >> 1;
+			for (; j & bit; bit >>= 1)
+				j ^= bit;
+			j ^= bit;
+			if (i < j)
+				swap(data[i], data[j]);
+		}
+
+		for (size_t length = 2; length <= n; length <<= 1) {
+			I_FREQ_TYPE angle = -2.0 * PI / length;
+			complex<I_FREQ_TYPE> step(cos(angle), sin(angle));
+
+			for (size_t i = 0; i < n; i += length) {
+				complex<I_FREQ_TYPE> w(1.0, 0.0);
+				for (size_t k = 0; k < length / 2; k++) {
+					complex<I_FREQ_TYPE> even = data[i + k];
+					complex<I_FREQ_TYPE> odd = data[i + k + length / 2] * w;
+					data[i + k] = even + odd;
+					data[i + k + length / 2] = even - odd;
+					w *= step;
+				}
+			}
+		}
+	}
+
+	// Hann windowed magnitude spectrum of 'size' samples (a power of two), size / 2 bins
+	void MagnitudeSpectrum(const I_FREQ_TYPE* samples, size_t size, vector<I_FREQ_TYPE>& magnitudes) {
+		vector<complex<I_FREQ_TYPE>> data(size);
+		for (size_t i = 0; i < size; i++) {
+			I_FREQ_TYPE window = 0.5 - 0.5 * cos(2.0 * PI * i / (size - 1));
+			data[i] = complex<I_FREQ_TYPE>(samples[i] * window, 0.0);
+		}
+
+		Fft(data);
+
+		magnitudes.resize(size / 2);
+		for (size_t i = 0; i < size / 2; i++)
+			magnitudes[i] = abs(data[i]);
+	}
+}
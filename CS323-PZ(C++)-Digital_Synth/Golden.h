@@ -0,0 +1,468 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <algorithm>
+using namespace std;
+
+#include "SynthEngine.h"
+#include "Fft.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	********************************************* GOLDEN AUDIO *****************************************************
+	****************************************************************************************************************/
+
+	// Regression check against stored renders. Every case renders offline on a fresh, seeded engine, so the
+	// output only changes when the DSP code does. The references live in Golden/ next to Patches/ and are
+	// committed with the code: a change that alters the output re-records them with --golden-record Golden
+	// in the same commit. --golden-check compares sample peak error and spectral difference against them.
+	// Timings only mean something on the machine that took them, so the ns/sample baseline is never
+	// committed: --perf-record Golden writes it to Golden/perf.local.txt, ignored by git, and the check
+	// gates ns/sample only where that file exists.
+
+	const unsigned int GOLDEN_SEED = 12345;
+	const unsigned int GOLDEN_SAMPLE_RATE = 44100;
+	const size_t GOLDEN_FFT_SIZE = 1024;
+	const int GOLDEN_TIMING_RUNS = 5;          // the fastest run is kept, short cases are noisy otherwise
+	const I_FREQ_TYPE GOLDEN_STEP = 65536.0;    // samples are stored in steps of 1/65536, well inside the peak tolerance
+
+	struct GoldenTolerance {
+		I_FREQ_TYPE peak;           // largest allowed absolute sample difference
+		I_FREQ_TYPE spectralDb;     // largest allowed spectral error energy relative to the golden, in dB
+		I_FREQ_TYPE regression;     // largest allowed ns/sample increase, in percent
+
+		GoldenTolerance() {
+			peak = 1e-4;
+			spectralDb = -60.0;
+			regression = 10.0;
+		}
+	};
+
+	struct GoldenCase {
+		string name;
+		vector<float> samples;
+		I_FREQ_TYPE nanosecondsPerSample;
+	};
+
+	// One held note, released after a second, on an instrument of a fresh seeded engine
+	static void RenderGoldenNote(SynthEngine& engine, BaseInstrument* instrument, GoldenCase& result) {
+		vector<I_FREQ_TYPE> block(GOLDEN_SAMPLE_RATE * 2);
+
+		auto start = chrono::high_resolution_clock::now();
+		engine.NoteOn(instrument, 64, 0.0);
+		engine.RenderOffline(block.data(), GOLDEN_SAMPLE_RATE);
+		engine.NoteOff(instrument, 64, engine.Time());
+		engine.RenderOffline(block.data() + GOLDEN_SAMPLE_RATE, GOLDEN_SAMPLE_RATE);
+		auto elapsed = chrono::duration<I_FREQ_TYPE, nano>(chrono::high_resolution_clock::now() - start).count();
+
+		result.samples.assign(block.begin(), block.end());
+		result.nanosecondsPerSample = elapsed / block.size();
+	}
+
+	static void RenderGoldenNote(BaseInstrument* (*pick)(SynthEngine&), GoldenCase& result) {
+		SynthEngine engine(GOLDEN_SAMPLE_RATE, 512, 0);
+		engine.SetSeed(GOLDEN_SEED);
+		RenderGoldenNote(engine, pick(engine), result);
+	}
+
+	// Fails when Patches/ is not in the working directory, the built-ins standing in would render another demo
+	static bool RenderGoldenDemo(GoldenCase& result) {
+		SynthEngine engine(GOLDEN_SAMPLE_RATE, 512, 0);
+		if (!engine.SetupDemo()) {
+			cerr << "Patches/ not found or incomplete, run from the project directory" << endl;
+			return false;
+		}
+		engine.SetSeed(GOLDEN_SEED);
+
+		vector<I_FREQ_TYPE> block(GOLDEN_SAMPLE_RATE * 4);
+
+		auto start = chrono::high_resolution_clock::now();
+		engine.RenderOffline(block.data(), (unsigned int)block.size());
+		auto elapsed = chrono::duration<I_FREQ_TYPE, nano>(chrono::high_resolution_clock::now() - start).count();
+
+		result.samples.assign(block.begin(), block.end());
+		result.nanosecondsPerSample = elapsed / block.size();
+		return true;
+	}
+
+	bool RenderGoldenCases(vector<GoldenCase>& cases) {
+		struct NoteCase {
+			const char* name;
+			BaseInstrument* (*pick)(SynthEngine&);
+		};
+
+		NoteCase notes[] = {
+			{ "bell", [](SynthEngine& e) -> BaseInstrument* { return &e.bell; } },
+			{ "bell8", [](SynthEngine& e) -> BaseInstrument* { return &e.bell8; } },
+			{ "harmonica", [](SynthEngine& e) -> BaseInstrument* { return &e.harmonica; } },
+			{ "supersaw", [](SynthEngine& e) -> BaseInstrument* { return &e.supersaw; } },
+			{ "kick", [](SynthEngine& e) -> BaseInstrument* { return &e.kickDrum; } },
+			{ "snare", [](SynthEngine& e) -> BaseInstrument* { return &e.snareDrum; } },
+			{ "hihat", [](SynthEngine& e) -> BaseInstrument* { return &e.hiHat; } },
+		};
+
+		cases.assign(sizeof(notes) / sizeof(notes[0]) + 1, GoldenCase());
+		for (size_t i = 0; i < cases.size(); i++) {
+			cases[i].name = i < cases.size() - 1 ? notes[i].name : "demo";
+			I_FREQ_TYPE fastest = HUGE_VAL;
+
+			for (int run = 0; run < GOLDEN_TIMING_RUNS; run++) {
+				if (i < cases.size() - 1)
+					RenderGoldenNote(notes[i].pick, cases[i]);
+				else if (!RenderGoldenDemo(cases[i]))
+					return false;
+				fastest = min(fastest, cases[i].nanosecondsPerSample);
+			}
+			cases[i].nanosecondsPerSample = fastest;
+		}
+
+		return true;
+	}
+
+	// "GLDQ", the sample count, then every sample in GOLDEN_STEP units as the zigzag varint of its difference
+	// to the previous one. About a third of float samples and the same bytes on every machine.
+	static bool WriteGolden(const string& path, const vector<float>& samples) {
+		ofstream file(path, ios::binary);
+		unsigned int count = (unsigned int)samples.size();
+		file.write("GLDQ", 4);
+		file.write((const char*)&count, 4);
+
+		string bytes;
+		long long previous = 0;
+		for (float sample : samples) {
+			long long quantized = llround(sample * GOLDEN_STEP);
+			long long delta = quantized - previous;
+			unsigned long long zigzag = ((unsigned long long)delta << 1) ^ (unsigned long long)(delta >> 63);
+			previous = quantized;
+
+			while (zigzag >= 0x80) {
+				bytes.push_back((char)((zigzag & 0x7F) | 0x80));
+				zigzag >>= 7;
+			}
+			bytes.push_back((char)zigzag);
+		}
+
+		file.write(bytes.data(), bytes.size());
+		return file.good();
+	}
+
+	static bool ReadGolden(const string& path, vector<float>& samples) {
+		ifstream file(path, ios::binary);
+		char magic[4];
+		unsigned int count = 0;
+		if (!file.read(magic, 4) || string(magic, 4) != "GLDQ" || !file.read((char*)&count, 4))
+			return false;
+
+		samples.resize(count);
+		long long previous = 0;
+		for (unsigned int i = 0; i < count; i++) {
+			unsigned long long zigzag = 0;
+			for (int shift = 0; ; shift += 7) {
+				int byte = file.get();
+				if (byte == EOF || shift > 63)
+					return false;
+				zigzag |= (unsigned long long)(byte & 0x7F) << shift;
+				if ((byte & 0x80) == 0)
+					break;
+			}
+
+			previous += (long long)(zigzag >> 1) ^ -(long long)(zigzag & 1);
+			samples[i] = (float)(previous / GOLDEN_STEP);
+		}
+		return true;
+	}
+
+	// Error energy of the magnitude spectra relative to the golden's, in dB, over consecutive FFT frames
+	I_FREQ_TYPE SpectralDifferenceDb(const vector<float>& actual, const vector<float>& golden) {
+		size_t length = min(actual.size(), golden.size());
+		vector<I_FREQ_TYPE> a(GOLDEN_FFT_SIZE), g(GOLDEN_FFT_SIZE), spectrumA, spectrumG;
+		I_FREQ_TYPE error = 0.0;
+		I_FREQ_TYPE reference = 0.0;
+
+		for (size_t frame = 0; frame + GOLDEN_FFT_SIZE <= length; frame += GOLDEN_FFT_SIZE) {
+			copy(actual.begin() + frame, actual.begin() + frame + GOLDEN_FFT_SIZE, a.begin());
+			copy(golden.begin() + frame, golden.begin() + frame + GOLDEN_FFT_SIZE, g.begin());
+			MagnitudeSpectrum(a.data(), GOLDEN_FFT_SIZE, spectrumA);
+			MagnitudeSpectrum(g.data(), GOLDEN_FFT_SIZE, spectrumG);
+
+			for (size_t k = 0; k < spectrumG.size(); k++) {
+				I_FREQ_TYPE d = spectrumA[k] - spectrumG[k];
+				error += d * d;
+				reference += spectrumG[k] * spectrumG[k];
+			}
+		}
+
+		if (error == 0.0)
+			return -HUGE_VAL;
+		return 10.0 * log10(error / max(reference, 1e-30));
+	}
+
+	// Renders every case and writes <dir>/<case>.golden
+	int RecordGolden(const string& dir) {
+		vector<GoldenCase> cases;
+		if (!RenderGoldenCases(cases))
+			return 1;
+
+		for (const GoldenCase& c : cases) {
+			if (!WriteGolden(dir + "/" + c.name + ".golden", c.samples)) {
+				cerr << dir << "/" << c.name << ".golden: write failed" << endl;
+				return 1;
+			}
+			cout << c.name << ": " << c.samples.size() << " samples" << endl;
+		}
+		return 0;
+	}
+
+	// Renders every case and writes this machine's ns/sample baseline to <dir>/perf.local.txt
+	int RecordPerfBaseline(const string& dir) {
+		vector<GoldenCase> cases;
+		if (!RenderGoldenCases(cases))
+			return 1;
+
+		ofstream perf(dir + "/perf.local.txt");
+		if (!perf.is_open()) {
+			cerr << dir << "/perf.local.txt: cannot write" << endl;
+			return 1;
+		}
+
+		for (const GoldenCase& c : cases) {
+			perf << c.name << " " << c.nanosecondsPerSample << endl;
+			cout << c.name << ": " << c.nanosecondsPerSample << " ns/sample" << endl;
+		}
+		return 0;
+	}
+
+	// Returns the number of failed cases. Without a local baseline the timings are reported, not gated.
+	int CheckGolden(const string& dir, const GoldenTolerance& tolerance) {
+		map<string, I_FREQ_TYPE> baseline;
+		ifstream perf(dir + "/perf.local.txt");
+		string name;
+		I_FREQ_TYPE ns;
+		while (perf >> name >> ns)
+			baseline[name] = ns;
+		if (baseline.empty())
+			cout << "no " << dir << "/perf.local.txt, ns/sample is not gated (--perf-record " << dir << ")" << endl;
+
+		vector<GoldenCase> cases;
+		if (!RenderGoldenCases(cases)) {
+			cout << "FAIL golden cases not rendered" << endl;
+			return 1;
+		}
+		int failed = 0;
+
+		for (const GoldenCase& c : cases) {
+			vector<float> golden;
+			if (!ReadGolden(dir + "/" + c.name + ".golden", golden)) {
+				cout << "FAIL " << c.name << ": no golden file" << endl;
+				failed++;
+				continue;
+			}
+
+			I_FREQ_TYPE peak = golden.size() == c.samples.size() ? 0.0 : HUGE_VAL;
+			for (size_t i = 0; i < min(golden.size(), c.samples.size()); i++)
+				peak = max(peak, (I_FREQ_TYPE)fabs(c.samples[i] - golden[i]));
+			I_FREQ_TYPE spectral = SpectralDifferenceDb(c.samples, golden);
+
+			I_FREQ_TYPE regression = 0.0;
+			auto b = baseline.find(c.name);
+			if (b != baseline.end() && b->second > 0.0)
+				regression = (c.nanosecondsPerSample / b->second - 1.0) * 100.0;
+
+			bool ok = peak <= tolerance.peak && spectral <= tolerance.spectralDb && regression <= tolerance.regression;
+			if (!ok)
+				failed++;
+
+			cout << (ok ? "ok   " : "FAIL ") << c.name << ": peak " << peak << ", spectral " << spectral << " dB, "
+				<< c.nanosecondsPerSample << " ns/sample";
+			if (b != baseline.end())
+				cout << " (" << (regression >= 0.0 ? "+" : "") << regression << "%)";
+			cout << endl;
+		}
+
+		cout << cases.size() - failed << "/" << cases.size() << " golden cases passed" << endl;
+		return failed;
+	}
+
+	// The files in Patches/ are ports of the built-in instruments and must render what they render, within
+	// the golden tolerances. Returns the number of failed patches.
+	int CheckPatchPorts(const GoldenTolerance& tolerance) {
+		struct Port {
+			const char* path;
+			BaseInstrument* (*pick)(SynthEngine&);
+		};
+
+		Port ports[] = {
+			{ "Patches/Bell.patch", [](SynthEngine& e) -> BaseInstrument* { return &e.bell; } },
+			{ "Patches/Bell8.patch", [](SynthEngine& e) -> BaseInstrument* { return &e.bell8; } },
+			{ "Patches/Harmonica.patch", [](SynthEngine& e) -> BaseInstrument* { return &e.harmonica; } },
+			{ "Patches/Supersaw.patch", [](SynthEngine& e) -> BaseInstrument* { return &e.supersaw; } },
+			{ "Patches/KickDrum.patch", [](SynthEngine& e) -> BaseInstrument* { return &e.kickDrum; } },
+			{ "Patches/SnareDrum.patch", [](SynthEngine& e) -> BaseInstrument* { return &e.snareDrum; } },
+			{ "Patches/HiHat.patch", [](SynthEngine& e) -> BaseInstrument* { return &e.hiHat; } },
+		};
+
+		int failed = 0;
+		for (const Port& port : ports) {
+			GoldenCase builtIn, patch;
+			RenderGoldenNote(port.pick, builtIn);
+
+			SynthEngine engine(GOLDEN_SAMPLE_RATE, 512, 0);
+			engine.SetSeed(GOLDEN_SEED);
+			BaseInstrument* instrument = engine.LoadInstrument(port.path);
+			if (instrument == nullptr) {
+				cout << "FAIL " << port.path << ": missing or malformed" << endl;
+				failed++;
+				continue;
+			}
+			RenderGoldenNote(engine, instrument, patch);
+
+			I_FREQ_TYPE peak = 0.0;
+			for (size_t i = 0; i < builtIn.samples.size(); i++)
+				peak = max(peak, (I_FREQ_TYPE)fabs(patch.samples[i] - builtIn.samples[i]));
+			I_FREQ_TYPE spectral = SpectralDifferenceDb(patch.samples, builtIn.samples);
+
+			bool ok = peak <= tolerance.peak && spectral <= tolerance.spectralDb;
+			if (!ok)
+				failed++;
+			cout << (ok ? "ok   " : "FAIL ") << port.path << ": peak " << peak << ", spectral " << spectral << " dB against the built-in" << endl;
+		}
+
+		return failed;
+	}
+
+	// The demo graph is a single chain, so it never gives the workers a level to share. This one has
+	// independent oscillator -> filter branches meeting in a mixer; rendered by the audio thread alone and
+	// with workers, the output must be the same sample for sample.
+	int CheckParallelGraph(int branches = 8, int blocks = 400, unsigned int frames = 512) {
+		auto build = [branches, frames]() {
+			DspGraph graph;
+			int mixer = graph.AddNode(make_shared<MixerNode>(1.0 / branches));
+			for (int b = 0; b < branches; b++) {
+				int oscillator = graph.AddNode(make_shared<OscillatorNode>(110.0 * (b + 1), b % 4 == 0 ? SAW_WAVE : SINE_WAVE));
+				int filter = graph.AddNode(make_shared<FilterNode>(500.0 + 250.0 * b));
+				graph.Connect(oscillator, filter);
+				graph.Connect(filter, mixer);
+			}
+			graph.SetOutput(mixer);
+			return graph.Compile(frames);
+		};
+
+		auto render = [blocks, frames](DspGraphRunner& runner, vector<I_FREQ_TYPE>& output) {
+			output.assign((size_t)blocks * frames, 0.0);
+			DspContext ctx;
+			ctx.timeStep = 1.0 / GOLDEN_SAMPLE_RATE;
+			ctx.frames = frames;
+			auto start = chrono::high_resolution_clock::now();
+			for (int b = 0; b < blocks; b++) {
+				ctx.time = (I_FREQ_TYPE)b * frames * ctx.timeStep;
+				runner.Process(ctx, output.data() + (size_t)b * frames);
+			}
+			return chrono::duration<I_FREQ_TYPE, nano>(chrono::high_resolution_clock::now() - start).count() / output.size();
+		};
+
+		DspGraphRunner serial(0), parallel(3);
+		serial.Submit(build());
+		parallel.Submit(build());
+
+		vector<I_FREQ_TYPE> expected, actual;
+		I_FREQ_TYPE serialNs = render(serial, expected);
+		I_FREQ_TYPE parallelNs = render(parallel, actual);
+
+		size_t mismatches = 0;
+		for (size_t i = 0; i < expected.size(); i++)
+			if (expected[i] != actual[i])
+				mismatches++;
+
+		bool ok = mismatches == 0;
+		cout << (ok ? "ok   " : "FAIL ") << "parallel graph, " << branches << " branches: " << mismatches << " samples differ, "
+			<< serialNs << " ns/sample alone, " << parallelNs << " ns/sample with " << parallel.WorkerCount() << " workers" << endl;
+		return ok ? 0 : 1;
+	}
+
+	// Fills every voice with notes that take no noise stream, then starts noisy notes that do not fit, lets
+	// everything finish and fills the voices again: the dropped notes must not keep a noise stream, a unison
+	// stack or a modulation slot, and the refill must get every one
+	int CheckVoiceOverflow(size_t voices = 16) {
+		SynthEngine engine(GOLDEN_SAMPLE_RATE, 512, 0, voices);
+		vector<I_FREQ_TYPE> block(GOLDEN_SAMPLE_RATE * 3);
+
+		for (size_t k = 0; k < voices; k++)
+			engine.NoteOn(&engine.bell, 48 + (int)k, 0.0);
+		for (size_t k = 0; k < voices / 2; k++)
+			engine.NoteOn(&engine.supersaw, 48 + (int)k, 0.0);
+		engine.RenderOffline(block.data(), 512);
+		for (size_t k = 0; k < voices; k++) {
+			engine.NoteOff(&engine.bell, 48 + (int)k, engine.Time());
+			engine.NoteOff(&engine.supersaw, 48 + (int)k, engine.Time());
+		}
+		engine.RenderOffline(block.data(), (unsigned int)block.size());
+
+		size_t freeVoices = engine.modulation.FreeVoices();
+		size_t freeNoise = engine.FreeNoiseStreams();
+		unsigned long long dropped = engine.DroppedNotes();
+
+		for (size_t k = 0; k < voices; k++)
+			engine.NoteOn(&engine.supersaw, 48 + (int)k, engine.Time());
+		bool refilled = engine.DroppedNotes() == dropped && engine.modulation.FreeVoices() == 0 && engine.FreeNoiseStreams() == 0;
+
+		bool ok = dropped == voices / 2 && freeVoices == voices && freeNoise == voices && refilled;
+		cout << (ok ? "ok   " : "FAIL ") << "voice overflow: " << dropped << " of " << voices + voices / 2 << " notes dropped, "
+			<< freeVoices << " modulation slots and " << freeNoise << " noise streams free after, refill "
+			<< (refilled ? "got every slot" : "came up short") << endl;
+		return ok ? 0 : 1;
+	}
+
+	/***************************************************************************************************************
+	******************************************* ALLOCATION CHECK ***************************************************
+	****************************************************************************************************************/
+
+	// Plays the demo for a few seconds through the engine, while keys go down and up and
+	// parameters move the way the UI would drive them. Only meaningful in a SYNTH_ALLOC_TRAP build, where an
+	// allocation on the audio thread aborts the process; any other build fails the check straight away.
+	int CheckAllocations(I_FREQ_TYPE seconds = 10.0) {
+#ifndef SYNTH_ALLOC_TRAP
+		cout << "FAIL allocation check: built without SYNTH_ALLOC_TRAP, nothing would trap" << endl;
+		return 1;
+#else
+		SynthEngine engine(GOLDEN_SAMPLE_RATE, 512);
+		if (!engine.SetupDemo()) {
+			cout << "FAIL allocation check: Patches/ not found or incomplete, run from the project directory" << endl;
+			return 1;
+		}
+		engine.SetSeed(GOLDEN_SEED);
+
+		int volume = engine.parameters.Find("master.volume");
+		int detune = engine.parameters.Find("supersaw.detune");
+		int attack = engine.parameters.Find("KickDrum.attack");
+
+		const unsigned int frames = 512;
+		vector<I_FREQ_TYPE> block(frames);
+		unsigned int blocks = (unsigned int)(seconds * GOLDEN_SAMPLE_RATE / frames);
+
+		for (unsigned int b = 0; b < blocks; b++) {
+			// A new chord key every 16 blocks, each held for 48
+			if (b % 16 == 0)
+				engine.NoteOn(engine.keyboardInstrument, 60 + (b / 16) % 12, engine.Time());
+			if (b >= 48 && b % 16 == 0)
+				engine.NoteOff(engine.keyboardInstrument, 60 + (b / 16 - 3) % 12, engine.Time());
+
+			engine.parameters.SetNormalized(volume, 0.5 + 0.25 * sin(b * 0.05));
+			engine.parameters.SetNormalized(detune, 0.5 + 0.5 * sin(b * 0.03));
+			if (b % 200 == 100)
+				engine.parameters.SetNormalized(attack, (b / 200) % 2 == 0 ? 0.1 : 0.0);
+
+			engine.RenderOffline(block.data(), frames);
+		}
+
+		cout << "ok   allocation check: " << blocks << " blocks on the audio thread without an allocation" << endl;
+		return 0;
+#endif
+	}
+}
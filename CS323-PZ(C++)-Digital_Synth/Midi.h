@@ -0,0 +1,182 @@
+#pragma once
+
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+using namespace std;
+
+#ifndef I_FREQ_TYPE
+#define I_FREQ_TYPE double
+#endif
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	************************************************** MIDI ********************************************************
+	****************************************************************************************************************/
+
+	struct MidiEvent {
+		I_FREQ_TYPE time; // seconds from the start of the file
+		bool on;
+		int channel;
+		int note;         // controller number for control changes
+		int velocity;     // controller value for control changes
+		bool control;     // control change rather than a note
+	};
+
+	// Minimal Standard MIDI File reader: format 0 and 1, note on / off, control changes and tempo changes. Everything else is
+	// skipped. Events from all tracks are merged and returned sorted by time.
+	bool LoadMidi(const string& path, vector<MidiEvent>& events) {
+		ifstream file(path, ios::binary);
+		if (!file.is_open())
+			return false;
+
+		vector<unsigned char> data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+		size_t pos = 0;
+
+		auto read32 = [&data, &pos]() -> unsigned int {
+			unsigned int v = (data[pos] << 24) | (data[pos + 1] << 16) | (data[pos + 2] << 8) | data[pos + 3];
+			pos += 4;
+			return v;
+		};
+		auto read16 = [&data, &pos]() -> unsigned int {
+			unsigned int v = (data[pos] << 8) | data[pos + 1];
+			pos += 2;
+			return v;
+		};
+
+		if (data.size() < 14 || string(data.begin(), data.begin() + 4) != "MThd")
+			return false;
+
+		pos = 4;
+		unsigned int headerLength = read32();
+		read16(); // format
+		unsigned int trackCount = read16();
+		unsigned int division = read16();
+		if (division == 0 || (division & 0x8000)) // SMPTE timing is not supported
+			return false;
+		pos = 8 + headerLength;
+
+		struct TickEvent {
+			unsigned long long tick;
+			int order;
+			bool tempo;
+			unsigned int microsecondsPerBeat;
+			MidiEvent event;
+		};
+		vector<TickEvent> ticks;
+
+		for (unsigned int t = 0; t < trackCount && pos + 8 <= data.size(); t++) {
+			bool isTrack = string(data.begin() + pos, data.begin() + pos + 4) == "MTrk";
+			pos += 4;
+			size_t length = read32();
+			size_t end = min(pos + length, data.size());
+			if (!isTrack) {
+				pos = end;
+				continue;
+			}
+
+			unsigned long long tick = 0;
+			unsigned char status = 0;
+
+			auto readVariable = [&data, &pos, end]() -> unsigned long long {
+				unsigned long long v = 0;
+				while (pos < end) {
+					unsigned char b = data[pos++];
+					v = (v << 7) | (b & 0x7F);
+					if (!(b & 0x80)) break;
+				}
+				return v;
+			};
+
+			while (pos < end) {
+				tick += readVariable();
+				if (pos >= end) break;
+
+				if (data[pos] & 0x80)
+					status = data[pos++];
+
+				if (status == 0xFF) {
+					unsigned char type = pos < end ? data[pos++] : 0;
+					size_t size = (size_t)readVariable();
+					if (type == 0x51 && size == 3 && pos + 3 <= end) {
+						TickEvent e = {};
+						e.tick = tick;
+						e.order = (int)ticks.size();
+						e.tempo = true;
+						e.microsecondsPerBeat = (data[pos] << 16) | (data[pos + 1] << 8) | data[pos + 2];
+						ticks.push_back(e);
+					}
+					pos += size;
+					status = 0;
+				}
+				else if (status == 0xF0 || status == 0xF7) {
+					pos += (size_t)readVariable();
+					status = 0;
+				}
+				else if (status >= 0x80) {
+					int kind = status & 0xF0;
+					int paramCount = (kind == 0xC0 || kind == 0xD0) ? 1 : 2;
+					if (pos + paramCount > end) break;
+
+					int a = data[pos];
+					int b = paramCount > 1 ? data[pos + 1] : 0;
+					pos += paramCount;
+
+					if (kind == 0x90 || kind == 0x80) {
+						TickEvent e = {};
+						e.tick = tick;
+						e.order = (int)ticks.size();
+						e.event.on = kind == 0x90 && b > 0;
+						e.event.channel = status & 0x0F;
+						e.event.note = a;
+						e.event.velocity = b;
+						ticks.push_back(e);
+					}
+					else if (kind == 0xB0) {
+						TickEvent e = {};
+						e.tick = tick;
+						e.order = (int)ticks.size();
+						e.event.control = true;
+						e.event.channel = status & 0x0F;
+						e.event.note = a;
+						e.event.velocity = b;
+						ticks.push_back(e);
+					}
+				}
+				else {
+					// Data byte without a running status, the file is corrupt
+					return false;
+				}
+			}
+
+			pos = end;
+		}
+
+		stable_sort(ticks.begin(), ticks.end(), [](const TickEvent& a, const TickEvent& b) {
+			return a.tick != b.tick ? a.tick < b.tick : a.order < b.order;
+		});
+
+		// Walk the merged list converting ticks to seconds through the tempo map
+		unsigned int microsecondsPerBeat = 500000;
+		unsigned long long lastTick = 0;
+		I_FREQ_TYPE seconds = 0.0;
+
+		for (const TickEvent& e : ticks) {
+			seconds += (I_FREQ_TYPE)(e.tick - lastTick) * microsecondsPerBeat / (1000000.0 * division);
+			lastTick = e.tick;
+
+			if (e.tempo) {
+				microsecondsPerBeat = e.microsecondsPerBeat;
+				continue;
+			}
+
+			MidiEvent m = e.event;
+			m.time = seconds;
+			events.push_back(m);
+		}
+
+		return true;
+	}
+}
@@ -0,0 +1,400 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+#include "Synthesizer.h"
+#include "Parameters.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	******************************************* MODULATION ENGINE **************************************************
+	****************************************************************************************************************/
+
+	// LFOs and envelopes evaluated once per control tick instead of once per oscillator and sample. Identical
+	// sources are registered once and shared: a key synced sine is the shared sin / cos of the clock rotated
+	// by each voice's note on angle, so no voice calls sin for it. Between ticks every value is a straight line
+	// (ModulationState), and the routes sum sources into the pitch and amplitude of each voice. Pitch routes are
+	// in semitones and the engine integrates the frequency they give into a phase term per voice, so a held
+	// envelope or an LFO with an offset bends the note for as long as it lasts. Parameters are modulated by
+	// name through parameter routes.
+
+	const unsigned int MOD_CONTROL_RATE = 32; // samples per control tick
+	const int MOD_VOICE_SOURCES = 8;          // sources one voice reads, its instrument's and its routes'
+	const int MOD_VOICE_ROUTES = 8;
+
+	struct ModSource {
+		bool envelope;
+		ModLfo lfo;
+		EnvelopeADSR envelopeShape;
+
+		// Shared per tick, at the end of the tick
+		I_FREQ_TYPE sine;   // sine LFOs: sin and cos of the clock angle
+		I_FREQ_TYPE cosine;
+		I_FREQ_TYPE value;  // free running LFOs
+
+		ModSource() {
+			envelope = false;
+			sine = 0.0;
+			cosine = 1.0;
+			value = 0.0;
+		}
+	};
+
+	struct ModRoute {
+		const BaseInstrument* instrument;
+		int source;
+		int target; // MOD_PITCH, depth in semitones, or MOD_AMPLITUDE
+		I_FREQ_TYPE depth;
+	};
+
+	struct ModParameterRoute {
+		int source;
+		int parameter;
+		I_FREQ_TYPE depth;
+	};
+
+	struct ModVoice {
+		I_FREQ_TYPE on;
+		I_FREQ_TYPE off;
+		int sources[MOD_VOICE_SOURCES];
+		I_FREQ_TYPE phaseCos[MOD_VOICE_SOURCES]; // key synced sines: the LFO angle at the note on
+		I_FREQ_TYPE phaseSin[MOD_VOICE_SOURCES];
+		int sourceCount;
+		int routes[MOD_VOICE_ROUTES];
+		int routeCount;
+		I_FREQ_TYPE semitones; // sum of the pitch routes at the start of the tick in progress
+	};
+
+	class ModulationEngine {
+
+	public:
+		ModulationEngine(unsigned int sampleRate = 44100, size_t maxVoices = 256) : m_voices(maxVoices) {
+			m_sampleRate = sampleRate;
+			m_controlRate = MOD_CONTROL_RATE;
+			m_countdown = 0;
+			m_tickSpan = (I_FREQ_TYPE)m_controlRate / sampleRate;
+			m_state.lines.assign(maxVoices * MOD_STRIDE * 2, 0.0);
+
+			m_free.reserve(maxVoices);
+			for (size_t v = maxVoices; v-- > 0;)
+				m_free.push_back((int)v);
+		}
+
+		// Setting up, before audio runs: the source and route tables are read by the audio thread without a lock
+
+		// Returns the shared slot of an identical LFO if there is one, -1 once every slot is taken
+		int AddLfo(const ModLfo& lfo) {
+			for (size_t s = 0; s < m_sources.size(); s++) {
+				const ModLfo& other = m_sources[s].lfo;
+				if (!m_sources[s].envelope && other.hertz == lfo.hertz && other.shape == lfo.shape && other.keySync == lfo.keySync)
+					return (int)s;
+			}
+
+			ModSource source;
+			source.lfo = lfo;
+			return AddSource(source);
+		}
+
+		int AddEnvelope(const EnvelopeADSR& envelope) {
+			for (size_t s = 0; s < m_sources.size(); s++) {
+				const EnvelopeADSR& other = m_sources[s].envelopeShape;
+				if (m_sources[s].envelope && other.attackTime == envelope.attackTime && other.decayTime == envelope.decayTime
+					&& other.sustainTime == envelope.sustainTime && other.releaseTime == envelope.releaseTime && other.startAmplitude == envelope.startAmplitude)
+					return (int)s;
+			}
+
+			ModSource source;
+			source.envelope = true;
+			source.envelopeShape = envelope;
+			return AddSource(source);
+		}
+
+		// Points an instrument's own LFO at its shared slot. Returns false when there is none left; the LFO is
+		// then evaluated exactly, as before.
+		bool BindLfo(const BaseInstrument* instrument, ModLfo& lfo) {
+			lfo.source = AddLfo(lfo);
+			if (lfo.source < 0)
+				return false;
+			m_uses.push_back(make_pair(instrument, lfo.source));
+			return true;
+		}
+
+		// Adds depth * source to the target of every voice the instrument plays
+		bool AddRoute(const BaseInstrument* instrument, int source, int target, I_FREQ_TYPE depth) {
+			if (source < 0 || source >= (int)m_sources.size() || target < 0 || target >= MOD_TARGETS)
+				return false;
+
+			ModRoute route;
+			route.instrument = instrument;
+			route.source = source;
+			route.target = target;
+			route.depth = depth;
+			m_routes.push_back(route);
+			m_uses.push_back(make_pair(instrument, source));
+			return true;
+		}
+
+		// Adds depth * LFO to a parameter's modulation slot once per block. The LFO runs on the clock; envelopes
+		// belong to voices and cannot drive parameters.
+		bool AddParameterRoute(int source, int parameter, I_FREQ_TYPE depth) {
+			if (source < 0 || source >= (int)m_sources.size() || m_sources[source].envelope || parameter < 0)
+				return false;
+
+			ModParameterRoute route;
+			route.source = source;
+			route.parameter = parameter;
+			route.depth = depth;
+			m_parameterRoutes.push_back(route);
+			return true;
+		}
+
+		bool HasRoutes(const BaseInstrument* instrument) const {
+			return any_of(m_routes.begin(), m_routes.end(), [instrument](const ModRoute& route) { return route.instrument == instrument; });
+		}
+
+		// 1 evaluates every sample. Call it while setting up or under the engine's lock.
+		void SetControlRate(unsigned int samples) {
+			m_controlRate = max(1u, samples);
+			m_countdown = 0;
+		}
+
+		unsigned int ControlRate() const { return m_controlRate; }
+
+		const ModulationState& State() const { return m_state; }
+
+		// Voice slots no note holds. Read it under the engine's lock or while no audio runs.
+		size_t FreeVoices() const { return m_free.size(); }
+
+		// Audio thread, or under the engine's lock
+
+		// Gives a live note its voice slot. Notes beyond the slot count keep modulation -1 and are evaluated exactly.
+		void Start(Note& n) {
+			if (n.channel == nullptr || m_free.empty())
+				return;
+
+			n.modulation = m_free.back();
+			m_free.pop_back();
+
+			ModVoice& voice = m_voices[n.modulation];
+			voice.on = n.on;
+			voice.off = n.off;
+			voice.sourceCount = 0;
+			voice.routeCount = 0;
+
+			for (auto& use : m_uses)
+				if (use.first == n.channel)
+					AddVoiceSource(voice, use.second);
+			for (size_t r = 0; r < m_routes.size() && voice.routeCount < MOD_VOICE_ROUTES; r++)
+				if (m_routes[r].instrument == n.channel)
+					voice.routes[voice.routeCount++] = (int)r;
+
+			for (int i = 0; i < voice.sourceCount; i++) {
+				const ModSource& source = m_sources[voice.sources[i]];
+				I_FREQ_TYPE angle = 2.0 * PI * source.lfo.hertz * voice.on;
+				voice.phaseCos[i] = cos(angle);
+				voice.phaseSin[i] = sin(angle);
+			}
+
+			// Exact values at both ends of the tick in progress
+			I_FREQ_TYPE* lines = &m_state.lines[n.modulation * MOD_STRIDE * 2];
+			I_FREQ_TYPE start[MOD_STRIDE];
+			I_FREQ_TYPE end[MOD_STRIDE];
+			ExactValues(voice, m_state.tickStart, start);
+			ExactValues(voice, m_state.tickStart + m_tickSpan, end);
+			for (int slot = 0; slot < MOD_STRIDE; slot++) {
+				lines[slot * 2] = start[slot];
+				lines[slot * 2 + 1] = (end[slot] - start[slot]) / m_tickSpan;
+			}
+
+			// The phase term is 0 at the note on and runs at the tick's mean rate
+			I_FREQ_TYPE rate = 0.5 * (PhaseRate(start[MOD_PITCH]) + PhaseRate(end[MOD_PITCH]));
+			lines[MOD_PITCH * 2] = -rate * (voice.on - m_state.tickStart);
+			lines[MOD_PITCH * 2 + 1] = rate;
+			voice.semitones = end[MOD_PITCH];
+		}
+
+		void Stop(Note& n) {
+			if (n.modulation < 0)
+				return;
+			m_free.push_back(n.modulation);
+			n.modulation = -1;
+		}
+
+		// Before the voices read their values at 'time': starts a control tick when one is due and returns how
+		// many of the next 'frames' samples run before the next one, at least 1
+		template<class Notes>
+		unsigned int Process(const Notes& notes, I_FREQ_TYPE time, I_FREQ_TYPE timeStep, unsigned int frames = 1) {
+			if (m_countdown == 0) {
+				Tick(notes, time, m_controlRate * timeStep);
+				m_countdown = m_controlRate;
+			}
+			unsigned int run = max(1u, min(frames, m_countdown));
+			m_countdown -= run;
+			return run;
+		}
+
+		// Gain for the voice's amplitude target
+		I_FREQ_TYPE Amplitude(const Note& n, I_FREQ_TYPE time) const {
+			if (n.modulation < 0)
+				return 1.0;
+			return max(0.0, 1.0 + m_state.Value(n.modulation, MOD_AMPLITUDE, time));
+		}
+
+		// Once per block, before the bank smooths its values
+		void ApplyParameterRoutes(ParameterBank& parameters, I_FREQ_TYPE time) {
+			for (size_t r = 0; r < m_parameterRoutes.size(); r++) {
+				int parameter = m_parameterRoutes[r].parameter;
+
+				// The first route to a parameter sums all of them
+				bool first = true;
+				for (size_t other = 0; other < r && first; other++)
+					first = m_parameterRoutes[other].parameter != parameter;
+				if (!first || parameter >= parameters.Count())
+					continue;
+
+				I_FREQ_TYPE amount = 0.0;
+				for (size_t other = r; other < m_parameterRoutes.size(); other++) {
+					const ModParameterRoute& route = m_parameterRoutes[other];
+					if (route.parameter == parameter) {
+						const ModLfo& lfo = m_sources[route.source].lfo;
+						amount += route.depth * LfoShapeValue(lfo.shape, lfo.hertz * time);
+					}
+				}
+				parameters.SetModulation(parameter, amount);
+			}
+		}
+
+	private:
+		int AddSource(const ModSource& source) {
+			if ((int)m_sources.size() >= MOD_SOURCES)
+				return -1;
+			m_sources.push_back(source);
+			return (int)m_sources.size() - 1;
+		}
+
+		// How fast the pitch phase term grows for a shift in semitones: OscillateModulated adds modulation * hertz
+		// to the phase, so a term growing at 2 pi (ratio - 1) per second plays the note at ratio times its pitch
+		static I_FREQ_TYPE PhaseRate(I_FREQ_TYPE semitones) {
+			if (semitones == 0.0)
+				return 0.0;
+			return 2.0 * PI * (pow(2.0, semitones / 12.0) - 1.0);
+		}
+
+		static void AddVoiceSource(ModVoice& voice, int source) {
+			for (int i = 0; i < voice.sourceCount; i++)
+				if (voice.sources[i] == source)
+					return;
+			if (voice.sourceCount < MOD_VOICE_SOURCES)
+				voice.sources[voice.sourceCount++] = source;
+		}
+
+		// Value of one voice source, from the shared values of the tick being set up
+		I_FREQ_TYPE SharedValue(const ModVoice& voice, int i, I_FREQ_TYPE time) {
+			ModSource& source = m_sources[voice.sources[i]];
+			if (source.envelope)
+				return source.envelopeShape.amplitude(time, voice.on, voice.off);
+			if (!source.lfo.keySync)
+				return source.value;
+			if (source.lfo.shape == SINE_WAVE)
+				return source.sine * voice.phaseCos[i] - source.cosine * voice.phaseSin[i]; // sin(a - b)
+			return LfoShapeValue(source.lfo.shape, source.lfo.hertz * (time - voice.on));
+		}
+
+		// Every slot of a voice at 'time', evaluated directly. Used at the note on only.
+		void ExactValues(const ModVoice& voice, I_FREQ_TYPE time, I_FREQ_TYPE* values) {
+			fill(values, values + MOD_STRIDE, 0.0);
+			for (int i = 0; i < voice.sourceCount; i++) {
+				ModSource& source = m_sources[voice.sources[i]];
+				values[MOD_TARGETS + voice.sources[i]] = source.envelope
+					? source.envelopeShape.amplitude(time, voice.on, voice.off)
+					: LfoShapeValue(source.lfo.shape, source.lfo.hertz * (source.lfo.keySync ? time - voice.on : time));
+			}
+			AddRoutes(voice, values);
+		}
+
+		void AddRoutes(const ModVoice& voice, I_FREQ_TYPE* values) const {
+			for (int r = 0; r < voice.routeCount; r++) {
+				const ModRoute& route = m_routes[voice.routes[r]];
+				values[route.target] += route.depth * values[MOD_TARGETS + route.source];
+			}
+		}
+
+		// Moves every line to start at 'time' and end at the values one tick later
+		template<class Notes>
+		void Tick(const Notes& notes, I_FREQ_TYPE time, I_FREQ_TYPE span) {
+			I_FREQ_TYPE next = time + span;
+			m_tickSpan = span;
+
+			// Nothing reads the values while no voice holds a slot, Start sets up its own lines
+			if (m_free.size() == m_voices.size()) {
+				m_state.tickStart = time;
+				return;
+			}
+
+			for (auto& source : m_sources) {
+				if (source.envelope)
+					continue;
+				if (source.lfo.shape == SINE_WAVE) {
+					I_FREQ_TYPE angle = 2.0 * PI * source.lfo.hertz * next;
+					source.sine = sin(angle);
+					source.cosine = cos(angle);
+				}
+				source.value = source.lfo.shape == SINE_WAVE ? source.sine : LfoShapeValue(source.lfo.shape, source.lfo.hertz * next);
+			}
+
+			for (auto& n : notes) {
+				if (n.modulation < 0)
+					continue;
+
+				ModVoice& voice = m_voices[n.modulation];
+				voice.off = n.off;
+
+				I_FREQ_TYPE end[MOD_STRIDE];
+				end[MOD_PITCH] = 0.0;
+				end[MOD_AMPLITUDE] = 0.0;
+				for (int i = 0; i < voice.sourceCount; i++)
+					end[MOD_TARGETS + voice.sources[i]] = SharedValue(voice, i, next);
+				AddRoutes(voice, end);
+
+				// Integrates the pitch over the tick, trapezoid between the shifts at both ends
+				I_FREQ_TYPE* lines = &m_state.lines[n.modulation * MOD_STRIDE * 2];
+				I_FREQ_TYPE semitones = end[MOD_PITCH];
+				I_FREQ_TYPE phase = lines[MOD_PITCH * 2] + lines[MOD_PITCH * 2 + 1] * (time - m_state.tickStart);
+				end[MOD_PITCH] = phase + 0.5 * span * (PhaseRate(voice.semitones) + PhaseRate(semitones));
+				voice.semitones = semitones;
+
+				for (int slot = 0; slot < MOD_TARGETS; slot++)
+					MoveLine(lines + slot * 2, end[slot], time, span);
+				for (int i = 0; i < voice.sourceCount; i++)
+					MoveLine(lines + (MOD_TARGETS + voice.sources[i]) * 2, end[MOD_TARGETS + voice.sources[i]], time, span);
+			}
+
+			m_state.tickStart = time;
+		}
+
+		// Continues from where the line is now, so a late or early tick never jumps
+		void MoveLine(I_FREQ_TYPE* line, I_FREQ_TYPE end, I_FREQ_TYPE time, I_FREQ_TYPE span) const {
+			I_FREQ_TYPE now = line[0] + line[1] * (time - m_state.tickStart);
+			line[0] = now;
+			line[1] = (end - now) / span;
+		}
+
+		unsigned int m_sampleRate;
+		unsigned int m_controlRate;
+		unsigned int m_countdown;
+		I_FREQ_TYPE m_tickSpan;
+
+		vector<ModSource> m_sources;
+		vector<ModRoute> m_routes;
+		vector<ModParameterRoute> m_parameterRoutes;
+		vector<pair<const BaseInstrument*, int>> m_uses;
+
+		ModulationState m_state;
+		vector<ModVoice> m_voices;
+		vector<int> m_free;
+	};
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+#include "Synthesizer.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	************************************************* NOISE ********************************************************
+	****************************************************************************************************************/
+
+	// Noise streams of their own for every voice. White noise is counter based: sample k of a stream is a hash
+	// of k and the stream's key, with no state carried from one sample to the next, so a whole block is filled
+	// by one loop the compiler vectorizes. Pink and band noise filter that block. A voice's stream depends only
+	// on the engine seed and the order the voices started in, never on the other voices or on the thread.
+
+	// lowbias32 by Chris Wellons
+	inline unsigned int NoiseHash(unsigned int x) {
+		x ^= x >> 16;
+		x *= 0x7feb352du;
+		x ^= x >> 15;
+		x *= 0x846ca68bu;
+		x ^= x >> 16;
+		return x;
+	}
+
+	// Sample 'counter' of the stream with keys 'key' and 'mix', in [-1, 1). Streams with different keys are
+	// the same sequence shifted; the second round with 'mix' breaks that.
+	inline I_FREQ_TYPE CounterNoise(unsigned int counter, unsigned int key, unsigned int mix) {
+		return (I_FREQ_TYPE)(int)NoiseHash(NoiseHash(counter + key) ^ mix) * (1.0 / 2147483648.0);
+	}
+
+	class NoiseSource {
+
+	public:
+		NoiseSource() {
+			Start(0, NoiseShape(), 44100);
+		}
+
+		void Start(unsigned long long seed, const NoiseShape& shape, unsigned int sampleRate) {
+			m_key = NoiseHash((unsigned int)seed);
+			m_mix = NoiseHash((unsigned int)(seed >> 32) ^ 0x9E3779B9u);
+			m_counter = 0;
+			m_color = shape.color;
+			fill(m_pink, m_pink + 7, 0.0);
+			m_z1 = 0.0;
+			m_z2 = 0.0;
+
+			// RBJ band pass with 0 dB at the centre
+			I_FREQ_TYPE omega = ConvertToHz(max(1.0, min(shape.hertz, 0.49 * sampleRate))) / sampleRate;
+			I_FREQ_TYPE alpha = sin(omega) / (2.0 * max(shape.q, 0.01));
+			I_FREQ_TYPE a0 = 1.0 + alpha;
+			m_b0 = alpha / a0;
+			m_a1 = -2.0 * cos(omega) / a0;
+			m_a2 = (1.0 - alpha) / a0;
+		}
+
+		// The next 'frames' samples of the stream
+		void Fill(I_FREQ_TYPE* output, unsigned int frames) {
+			const unsigned int counter = m_counter;
+			const unsigned int key = m_key;
+			const unsigned int mix = m_mix;
+			for (unsigned int i = 0; i < frames; i++)
+				output[i] = CounterNoise(counter + i, key, mix);
+			m_counter += frames;
+
+			if (m_color == NOISE_COLOR_PINK)
+				Pink(output, frames);
+			else if (m_color == NOISE_COLOR_BAND)
+				Band(output, frames);
+		}
+
+	private:
+		// Paul Kellett's refined pink filter, within 0.05 dB above 9 Hz at 44.1 kHz
+		void Pink(I_FREQ_TYPE* samples, unsigned int frames) {
+			I_FREQ_TYPE* b = m_pink;
+			for (unsigned int i = 0; i < frames; i++) {
+				I_FREQ_TYPE white = samples[i];
+				b[0] = 0.99886 * b[0] + white * 0.0555179;
+				b[1] = 0.99332 * b[1] + white * 0.0750759;
+				b[2] = 0.96900 * b[2] + white * 0.1538520;
+				b[3] = 0.86650 * b[3] + white * 0.3104856;
+				b[4] = 0.55000 * b[4] + white * 0.5329522;
+				b[5] = -0.7616 * b[5] - white * 0.0168980;
+				samples[i] = (b[0] + b[1] + b[2] + b[3] + b[4] + b[5] + b[6] + white * 0.5362) * 0.11;
+				b[6] = white * 0.115926;
+			}
+		}
+
+		// Transposed direct form II, b1 is 0 and b2 is -b0
+		void Band(I_FREQ_TYPE* samples, unsigned int frames) {
+			for (unsigned int i = 0; i < frames; i++) {
+				I_FREQ_TYPE input = samples[i];
+				I_FREQ_TYPE output = m_b0 * input + m_z1;
+				m_z1 = -m_a1 * output + m_z2;
+				m_z2 = -m_b0 * input - m_a2 * output;
+				samples[i] = output;
+			}
+		}
+
+		unsigned int m_key;
+		unsigned int m_mix;
+		unsigned int m_counter;
+		int m_color;
+		I_FREQ_TYPE m_pink[7];
+		I_FREQ_TYPE m_b0, m_a1, m_a2;
+		I_FREQ_TYPE m_z1, m_z2;
+	};
+
+	// One noise source per live voice that plays noise, filled a block at a time before the voices render.
+	// Start, Stop and Render run under the engine's voice lock.
+	class NoiseBank {
+
+	public:
+		NoiseBank(unsigned int sampleRate = 44100, size_t maxVoices = 256, unsigned int maxFrames = 512)
+			: m_sources(maxVoices), m_used(maxVoices, false) {
+			m_sampleRate = sampleRate;
+			m_blocks.stride = maxFrames;
+			m_blocks.samples.assign(maxVoices * maxFrames, 0.0);
+			Seed(0);
+		}
+
+		// Restarts the voice count, so the same voices started in the same order get the same streams
+		void Seed(unsigned int seed) {
+			m_seed = seed;
+			m_started = 0;
+		}
+
+		// Gives a note of an instrument that plays noise a stream of its own. Without a free slot the note reads
+		// the shared stream.
+		void Start(Note& n) {
+			n.noise = -1;
+			if (n.channel == nullptr || n.channel->noise.color == NOISE_COLOR_NONE)
+				return;
+
+			for (size_t slot = 0; slot < m_used.size(); slot++)
+				if (!m_used[slot]) {
+					m_used[slot] = true;
+					unsigned long long seed = ((unsigned long long)NoiseHash(m_seed) << 32) | m_started++;
+					m_sources[slot].Start(seed, n.channel->noise, m_sampleRate);
+					n.noise = (int)slot;
+					return;
+				}
+		}
+
+		void Stop(Note& n) {
+			if (n.noise >= 0)
+				m_used[n.noise] = false;
+			n.noise = -1;
+		}
+
+		// Fills this block's noise of every voice that has a stream
+		void Render(I_FREQ_TYPE blockStart, I_FREQ_TYPE timeStep, unsigned int frames) {
+			m_blocks.blockStart = blockStart;
+			m_blocks.timeStep = timeStep;
+			m_blocks.frames = min(frames, m_blocks.stride);
+
+			for (size_t slot = 0; slot < m_used.size(); slot++)
+				if (m_used[slot])
+					m_sources[slot].Fill(&m_blocks.samples[slot * m_blocks.stride], m_blocks.frames);
+		}
+
+		size_t FreeStreams() const {
+			return count(m_used.begin(), m_used.end(), false);
+		}
+
+		const NoiseBlocks& Blocks() const {
+			return m_blocks;
+		}
+
+	private:
+		unsigned int m_sampleRate;
+		unsigned int m_seed;
+		unsigned int m_started;
+		vector<NoiseSource> m_sources;
+		vector<bool> m_used;
+		NoiseBlocks m_blocks;
+	};
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <mutex>
+using namespace std;
+
+#include "Synthesizer.h"
+#include "Noise.h"
+#include "AudioArena.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	*********************************************** ONE SHOTS ******************************************************
+	****************************************************************************************************************/
+
+	const int ONE_SHOT_VARIANTS = 4; // noise variants per hit, played round robin so repeats are not identical
+	const size_t ONE_SHOT_CHUNK = 1024; // samples rendered per hold of the voice lock
+
+	typedef vector<I_FREQ_TYPE, AlignedAllocator<I_FREQ_TYPE, 64>> OneShotBuffer;
+
+	// A percussive voice rendered once per (instrument, note id). A hit plays it back instead of running the
+	// instrument, which turns a dense drum pattern into a buffer add per voice. The entry remembers the
+	// instrument's parameters, a hit only uses it while they still match.
+	struct OneShot {
+		BaseInstrument* instrument;
+		int id;
+		unsigned long long parameters;
+		vector<OneShotBuffer> variants; // sample k is the sound k samples after the note on
+
+		OneShot() {
+			instrument = nullptr;
+			id = 0;
+			parameters = 0;
+		}
+	};
+
+	// Only voices that decay to silence by themselves and stop dead on note off sound the same from a
+	// buffer: zero sustain level and zero release
+	bool IsOneShotInstrument(const BaseInstrument& instrument) {
+		return instrument.envelopeOutput.sustainTime <= 0.0 && instrument.envelopeOutput.releaseTime <= 0.0;
+	}
+
+	// Renders every variant of 'id' on 'instrument' with the trailing silence trimmed. Variants that come out
+	// the same (no noise in the voice) are collapsed into one. 'voiceLock' is the lock the audio thread holds
+	// while the parameter bank writes the instrument's fields; the render reads them in chunks under it and
+	// gives up, returning false, when they changed since the first chunk. Each variant is started like a live
+	// note and holds one of the instrument's voice slots while it renders; with none free it gives up too.
+	// Its noise comes from a stream of its own in the instrument's colour, as a live voice's does.
+	bool RenderOneShot(BaseInstrument& instrument, int id, unsigned int sampleRate, OneShot& shot, mutex& voiceLock) {
+		unique_lock<mutex> lm(voiceLock);
+		shot.instrument = &instrument;
+		shot.id = id;
+		shot.parameters = instrument.CachedParameterHash();
+		shot.variants.clear();
+
+		const EnvelopeADSR& envelope = instrument.envelopeOutput;
+		I_FREQ_TYPE length = envelope.attackTime + envelope.decayTime;
+		if (instrument.maxLifeTme > 0.0)
+			length = min(length, instrument.maxLifeTme);
+		size_t samples = (size_t)ceil(length * sampleRate) + 2;
+
+		Note note;
+		note.id = id;
+		note.active = true;
+		note.channel = &instrument;
+		instrument.Prepare(note);
+		NoiseShape noiseShape = instrument.noise;
+		lm.unlock();
+
+		NoiseBlocks noiseBlocks;
+		noiseBlocks.stride = (unsigned int)ONE_SHOT_CHUNK;
+		noiseBlocks.timeStep = 1.0 / sampleRate;
+		noiseBlocks.samples.assign(ONE_SHOT_CHUNK, 0.0);
+		NoiseBlocksScope noiseBlocksScope(noiseBlocks);
+		NoiseSource noiseSource;
+
+		for (int v = 0; v < ONE_SHOT_VARIANTS; v++) {
+			NoiseState noiseState(0x9E3779B9u * (v + 1));
+			NoiseScope noise(noiseState);
+			noiseSource.Start(0x9E3779B97F4A7C15ull * (v + 1), noiseShape, sampleRate);
+			OneShotBuffer buffer(1, 0.0); // the note is silent on its first sample
+			buffer.reserve(samples);
+
+			lm.lock();
+			instrument.NoteStarted(note);
+			bool refused = note.voice == VOICE_REFUSED;
+			lm.unlock();
+			note.noise = noiseShape.color != NOISE_COLOR_NONE ? 0 : -1;
+			if (refused)
+				return false;
+
+			bool noteFinished = false;
+			for (size_t k = 1; k < samples && !noteFinished;) {
+				size_t end = min(samples, k + ONE_SHOT_CHUNK);
+				noiseBlocks.blockStart = (I_FREQ_TYPE)k / sampleRate;
+				noiseBlocks.frames = (unsigned int)(end - k);
+				noiseSource.Fill(noiseBlocks.samples.data(), noiseBlocks.frames);
+
+				lm.lock();
+				if (instrument.CachedParameterHash() != shot.parameters) {
+					instrument.NoteStopped(note);
+					return false;
+				}
+
+				for (; k < end && !noteFinished; k++)
+					buffer.push_back(instrument.sound((I_FREQ_TYPE)k / sampleRate, note, noteFinished));
+				lm.unlock();
+			}
+
+			lm.lock();
+			instrument.NoteStopped(note);
+			lm.unlock();
+
+			while (buffer.size() > 1 && buffer.back() == 0.0)
+				buffer.pop_back();
+
+			if (v == 1 && buffer == shot.variants[0])
+				break;
+			shot.variants.push_back(buffer);
+		}
+		return true;
+	}
+
+	// Adds the part of a cached hit that falls in this block. Returns false once the hit has played out or
+	// was cut by a note off.
+	bool MixOneShot(const Note& n, I_FREQ_TYPE time, I_FREQ_TYPE timeStep, unsigned int frames, I_FREQ_TYPE* output) {
+		const OneShotBuffer& buffer = n.oneShot->variants[n.oneShotVariant % n.oneShot->variants.size()];
+
+		long long first = llround((time - n.on) / timeStep);
+		long long end = (long long)buffer.size();
+		if (n.off > n.on)
+			end = min(end, llround((n.off - n.on) / timeStep));
+
+		long long from = max(first, 1LL);
+		long long to = min(first + (long long)frames, end);
+
+		for (long long k = from; k < to; k++)
+			output[k - first] += buffer[k] * n.velocity;
+
+		return first + (long long)frames < end;
+	}
+}
@@ -13,6 +13,9 @@
 using namespace std;
 
 #include <Windows.h>
+#include "RealtimeProfile.h"
+#include "Trace.h"
+#include "AudioTap.h"
 
 #ifndef I_FREQ_TYPE
 #define I_FREQ_TYPE double
@@ -20,6 +23,9 @@ using namespace std;
 
 const double PI = 2.0 * acos(0.0);
 
+// Fills 'frames' interleaved frames of 'channels' samples starting at 'time'
+typedef void(*BlockFunction)(void* userData, I_FREQ_TYPE* output, unsigned int frames, unsigned int channels, I_FREQ_TYPE time, I_FREQ_TYPE timeStep);
+
 template<class T>
 class NoiseGenerator {
 
@@ -30,6 +36,7 @@ public:
 
 	~NoiseGenerator() {
 		Destroy();
+		synthesizer::TraceUnregister(m_callbackTrace);
 	}
 
 	bool Generate(wstring outputDevice, unsigned int sampleRate = 44100, unsigned int channels = 1, unsigned int blocks = 8, unsigned int blockSamples = 512) {
@@ -44,6 +51,14 @@ public:
 		m_waveHeadersPointer = nullptr;
 
 		m_userFunction = nullptr;
+		m_blockFunction = nullptr;
+		m_blockUserData = nullptr;
+		m_profileRequested = false;
+		m_profileApplied = false;
+		m_tap = nullptr;
+
+		// The driver's callback thread records into a ring registered here, it must not allocate to get one
+		m_callbackTrace = synthesizer::TraceRegister("device callback");
 
 		// Validate device
 		vector<wstring> devices = EnumerateDevices();
@@ -76,6 +91,8 @@ public:
 			return Destroy();
 		ZeroMemory(m_waveHeadersPointer, sizeof(WAVEHDR) * m_blockCount);
 
+		m_renderBuffer.assign(m_blockSamples, 0.0);
+
 		// Link headers to block memory
 		for (unsigned int n = 0; n < m_blockCount; n++) {
 			m_waveHeadersPointer[n].dwBufferLength = m_blockSamples * sizeof(T);
@@ -125,6 +142,33 @@ public:
 		m_userFunction = func;
 	}
 
+	// Renders whole blocks through func instead of calling the user function once per sample
+	void SetBlockFunction(BlockFunction func, void* userData) {
+		m_blockUserData = userData;
+		m_blockFunction = func;
+	}
+
+	// Every rendered block is copied into the tap before it is clipped, nullptr stops the copies
+	void SetTap(synthesizer::AudioTap* tap) {
+		m_tap = tap;
+	}
+
+	// The render thread applies the profile to itself before its next block; the report is valid once
+	// RealtimeProfileApplied() returns true
+	void SetRealtimeProfile(const synthesizer::RealtimeProfile& profile) {
+		m_profile = profile;
+		m_profileApplied = false;
+		m_profileRequested = true;
+	}
+
+	bool RealtimeProfileApplied() const {
+		return m_profileApplied;
+	}
+
+	string RealtimeReport() const {
+		return m_profileApplied ? m_profileReport : string();
+	}
+
 	I_FREQ_TYPE clip(I_FREQ_TYPE sample, I_FREQ_TYPE max) {
 		if (sample >= 0.0)
 			return fmin(sample, max);
@@ -135,6 +179,16 @@ public:
 
 private:
 	I_FREQ_TYPE(*m_userFunction)(int, I_FREQ_TYPE);
+	BlockFunction m_blockFunction;
+	void* m_blockUserData;
+	vector<I_FREQ_TYPE> m_renderBuffer;
+
+	synthesizer::RealtimeProfile m_profile;
+	string m_profileReport;
+	atomic<bool> m_profileRequested;
+	atomic<bool> m_profileApplied;
+	atomic<synthesizer::AudioTap*> m_tap;
+	synthesizer::TraceBuffer* m_callbackTrace;
 
 	unsigned int m_sampleRate;
 	unsigned int m_channels;
@@ -157,6 +211,8 @@ private:
 	void waveOutProc(HWAVEOUT waveOut, UINT msg, DWORD param1, DWORD param2) {
 		if (msg != WOM_DONE) return;
 
+		synthesizer::TraceInstant(m_callbackTrace, "block done");
+
 		m_atomicFreeBlock++;
 		unique_lock<mutex> lm(m_muxBlockNotZero);
 		m_blockNotZeroConditionVariable.notify_one();
@@ -166,7 +222,24 @@ private:
 		((NoiseGenerator*)instance)->waveOutProc(waveOut, msg, param1, param2);
 	}
 
+	void ApplyRealtimeProfile() {
+		string report = synthesizer::ApplyThreadProfile(m_profile);
+
+		if (m_profile.enabled && m_profile.lockMemory) {
+			bool locked = synthesizer::LockAudioMemory(m_blockMemoryPointer, sizeof(T) * m_blockCount * m_blockSamples);
+			locked = synthesizer::LockAudioMemory(m_waveHeadersPointer, sizeof(WAVEHDR) * m_blockCount) && locked;
+			locked = synthesizer::LockAudioMemory(m_renderBuffer.data(), sizeof(I_FREQ_TYPE) * m_renderBuffer.size()) && locked;
+			report += locked ? ", blocks locked" : ", block lock refused";
+		}
+
+		m_profileReport = report;
+		m_profileApplied = true;
+	}
+
 	void MainThread() {
+		synthesizer::TraceThread("render");
+		unsigned long long blocksSent = 0;
+
 		m_globalTime = 0.0;
 		I_FREQ_TYPE timeStep = 1.0 / (I_FREQ_TYPE)m_sampleRate;
 
@@ -175,7 +248,15 @@ private:
 		T genericPreviousSample = 0;
 
 		while (m_ready) {
+			if (m_profileRequested.exchange(false))
+				ApplyRealtimeProfile();
+
+			// Every block back from the device means it has been playing silence
+			if (blocksSent >= m_blockCount && m_atomicFreeBlock == m_blockCount)
+				synthesizer::TraceUnderrun();
+
 			if (m_atomicFreeBlock== 0) {
+				synthesizer::TraceScope trace("device wait");
 				unique_lock<mutex> lm(m_muxBlockNotZero);
 				while (m_atomicFreeBlock== 0) 
 					m_blockNotZeroConditionVariable.wait(lm);
@@ -190,23 +271,40 @@ private:
 			T genericNewSample = 0;
 			int currentBlock = m_blockCurrent * m_blockSamples;
 
-			for (unsigned int n = 0; n < m_blockSamples; n += m_channels) {
-				for (unsigned int c = 0; c < m_channels; c++) {
-					if (m_userFunction == nullptr)
-						genericNewSample = (T)(clip(UserProcess(c, m_globalTime), 1.0) * maxSample);
-					else
-						genericNewSample = (T)(clip(m_userFunction(c, m_globalTime), 1.0) * maxSample);
+			if (m_blockFunction != nullptr) {
+				synthesizer::TraceScope trace("render block");
+				unsigned int frames = m_blockSamples / m_channels;
+				m_blockFunction(m_blockUserData, m_renderBuffer.data(), frames, m_channels, m_globalTime, timeStep);
 
-					m_blockMemoryPointer[currentBlock + n + c] = genericNewSample;
-					genericPreviousSample = genericNewSample;
-				}
+				synthesizer::AudioTap* tap = m_tap.load(memory_order_acquire);
+				if (tap != nullptr)
+					tap->Write(m_renderBuffer.data(), frames, m_channels);
 
-				m_globalTime = m_globalTime + timeStep;
+				for (unsigned int n = 0; n < frames * m_channels; n++)
+					m_blockMemoryPointer[currentBlock + n] = (T)(clip(m_renderBuffer[n], 1.0) * maxSample);
+
+				m_globalTime = m_globalTime + timeStep * frames;
+			}
+			else {
+				for (unsigned int n = 0; n < m_blockSamples; n += m_channels) {
+					for (unsigned int c = 0; c < m_channels; c++) {
+						if (m_userFunction == nullptr)
+							genericNewSample = (T)(clip(UserProcess(c, m_globalTime), 1.0) * maxSample);
+						else
+							genericNewSample = (T)(clip(m_userFunction(c, m_globalTime), 1.0) * maxSample);
+
+						m_blockMemoryPointer[currentBlock + n + c] = genericNewSample;
+						genericPreviousSample = genericNewSample;
+					}
+
+					m_globalTime = m_globalTime + timeStep;
+				}
 			}
 
 			// Send block to sound device
 			waveOutPrepareHeader(m_hwDevice, &m_waveHeadersPointer[m_blockCurrent], sizeof(WAVEHDR));
 			waveOutWrite(m_hwDevice, &m_waveHeadersPointer[m_blockCurrent], sizeof(WAVEHDR));
+			blocksSent++;
 			m_blockCurrent++;
 			m_blockCurrent %= m_blockCount;
 		}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+using namespace std;
+
+#include "OscilatorThread.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	********************************************** PARAMETERS ******************************************************
+	****************************************************************************************************************/
+
+	// Applies a smoothed value on the audio thread
+	typedef void(*ParameterFunction)(void* userData, I_FREQ_TYPE value);
+
+	// One automatable control. Any thread writes the target; only the audio thread moves 'current' towards
+	// it and writes the result into the bound field, so the instruments keep reading plain members.
+	struct Parameter {
+		string name;
+		I_FREQ_TYPE minimum;
+		I_FREQ_TYPE maximum;
+		I_FREQ_TYPE smoothingTime;  // seconds to get most of the way to a new target, 0 jumps
+		atomic<I_FREQ_TYPE> target;
+		atomic<bool> moving;        // the value moved in the last block, by smoothing or by modulation
+
+		// Audio thread only
+		I_FREQ_TYPE current;
+		I_FREQ_TYPE previous;       // value at the start of the last block, for consumers that ramp inside it
+		I_FREQ_TYPE modulation;     // added to the smoothed value every block, owned by whatever modulates it
+		I_FREQ_TYPE* field;
+		bool* changed;              // set whenever the field is written, e.g. an instrument's parametersChanged
+		ParameterFunction function;
+		void* userData;
+
+		Parameter(I_FREQ_TYPE value) : target(value), moving(false) {
+			minimum = 0.0;
+			maximum = 1.0;
+			smoothingTime = 0.02;
+			current = value;
+			previous = value;
+			modulation = 0.0;
+			field = nullptr;
+			changed = nullptr;
+			function = nullptr;
+			userData = nullptr;
+		}
+
+		I_FREQ_TYPE Value() const {
+			return max(minimum, min(current + modulation, maximum));
+		}
+	};
+
+	const int MIDI_CONTROLLERS = 128;
+
+	// Parameters are registered while setting up, before audio runs, and addressed by id afterwards. Set,
+	// ControlChange and MapController never lock, so the UI, automation lanes and MIDI input can drive them
+	// from any thread.
+	class ParameterBank {
+
+	public:
+		ParameterBank() {
+			for (int c = 0; c < MIDI_CONTROLLERS; c++)
+				m_controllers[c] = -1;
+		}
+
+		// Binds a plain field, which then must only be written through the bank. Every write also sets *changed
+		// when it is given.
+		int Add(const string& name, I_FREQ_TYPE* field, I_FREQ_TYPE minimum, I_FREQ_TYPE maximum, I_FREQ_TYPE smoothingTime = 0.02, bool* changed = nullptr) {
+			int id = Add(name, *field, minimum, maximum, smoothingTime);
+			m_parameters[id]->field = field;
+			m_parameters[id]->changed = changed;
+			return id;
+		}
+
+		// Calls function(userData, value) on the audio thread whenever the smoothed value moves
+		int Add(const string& name, ParameterFunction function, void* userData, I_FREQ_TYPE value, I_FREQ_TYPE minimum, I_FREQ_TYPE maximum, I_FREQ_TYPE smoothingTime = 0.02) {
+			int id = Add(name, value, minimum, maximum, smoothingTime);
+			m_parameters[id]->function = function;
+			m_parameters[id]->userData = userData;
+			return id;
+		}
+
+		// Returns -1 for an unknown name
+		int Find(const string& name) const {
+			for (size_t p = 0; p < m_parameters.size(); p++)
+				if (m_parameters[p]->name == name)
+					return (int)p;
+			return -1;
+		}
+
+		int Count() const {
+			return (int)m_parameters.size();
+		}
+
+		const Parameter& operator[](int id) const {
+			return *m_parameters[id];
+		}
+
+		bool Set(int id, I_FREQ_TYPE value) {
+			if (id < 0 || id >= (int)m_parameters.size())
+				return false;
+			Parameter& p = *m_parameters[id];
+			p.target.store(max(p.minimum, min(value, p.maximum)), memory_order_relaxed);
+			return true;
+		}
+
+		// 0.0 - 1.0 across the parameter's range
+		bool SetNormalized(int id, I_FREQ_TYPE amount) {
+			if (id < 0 || id >= (int)m_parameters.size())
+				return false;
+			Parameter& p = *m_parameters[id];
+			return Set(id, p.minimum + max(0.0, min(amount, 1.0)) * (p.maximum - p.minimum));
+		}
+
+		I_FREQ_TYPE Get(int id) const {
+			return m_parameters[id]->target.load(memory_order_relaxed);
+		}
+
+		void MapController(int controller, int id) {
+			if (controller >= 0 && controller < MIDI_CONTROLLERS)
+				m_controllers[controller] = id;
+		}
+
+		// MIDI CC value 0 - 127 to the mapped parameter's range
+		bool ControlChange(int controller, int value) {
+			if (controller < 0 || controller >= MIDI_CONTROLLERS)
+				return false;
+			return SetNormalized(m_controllers[controller].load(memory_order_relaxed), value / 127.0);
+		}
+
+		// Audio thread only
+		void SetModulation(int id, I_FREQ_TYPE amount) {
+			m_parameters[id]->modulation = amount;
+		}
+
+		// False while a parameter that sets 'changed' is still moving, as of the last block; nullptr asks about
+		// every parameter. Ask per instrument: one under a modulation route never settles, the rest still can.
+		// Safe from any thread.
+		bool Settled(const bool* changed = nullptr) const {
+			for (auto& parameter : m_parameters)
+				if ((changed == nullptr || parameter->changed == changed) && parameter->moving.load(memory_order_relaxed))
+					return false;
+			return true;
+		}
+
+		// Audio thread, once per block: one pole smoothing towards each target, then applies whatever moved
+		void Process(unsigned int frames, unsigned int sampleRate) {
+			for (auto& parameter : m_parameters) {
+				Parameter& p = *parameter;
+				I_FREQ_TYPE applied = p.Value();
+				I_FREQ_TYPE target = p.target.load(memory_order_relaxed);
+
+				p.previous = applied;
+				if (p.smoothingTime <= 0.0 || fabs(target - p.current) < 1e-9 * max(1.0, fabs(target)))
+					p.current = target;
+				else
+					p.current += (target - p.current) * (1.0 - exp(-(I_FREQ_TYPE)frames / (p.smoothingTime * sampleRate)));
+
+				I_FREQ_TYPE value = p.Value();
+				bool moved = value != applied || (p.field != nullptr && *p.field != value);
+				if (moved != p.moving.load(memory_order_relaxed))
+					p.moving.store(moved, memory_order_relaxed);
+				if (!moved)
+					continue;
+
+				if (p.field != nullptr) {
+					*p.field = value;
+					if (p.changed != nullptr)
+						*p.changed = true;
+				}
+				if (p.function != nullptr)
+					p.function(p.userData, value);
+			}
+		}
+
+	private:
+		int Add(const string& name, I_FREQ_TYPE value, I_FREQ_TYPE minimum, I_FREQ_TYPE maximum, I_FREQ_TYPE smoothingTime) {
+			unique_ptr<Parameter> parameter(new Parameter(max(minimum, min(value, maximum))));
+			parameter->name = name;
+			parameter->minimum = minimum;
+			parameter->maximum = maximum;
+			parameter->smoothingTime = smoothingTime;
+			m_parameters.push_back(move(parameter));
+			return (int)m_parameters.size() - 1;
+		}
+
+		vector<unique_ptr<Parameter>> m_parameters;
+		atomic<int> m_controllers[MIDI_CONTROLLERS];
+	};
+}
@@ -0,0 +1,590 @@
+#pragma once
+
+#include <cmath>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <atomic>
+using namespace std;
+
+#include "Synthesizer.h"
+#include "Modulation.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	*********************************************** PATCHES ********************************************************
+	****************************************************************************************************************/
+
+	// Patch file format, one statement per line, '#' starts a comment:
+	//
+	//   name Bell
+	//   volume 1.0
+	//   envelope <attack> <decay> <sustain> <release>
+	//   maxlife 3.0
+	//   finish envelope|lifetime
+	//   tuning equal|just
+	//   noise white|pink|band <hz> <q>
+	//   osc <sine|square|triangle|saw|noise> <transpose> <gain> [lfo <hz> <amplitude>] [harmonics <n>] [hz <fixed>] [reverse]
+	//       [unison <voices> <detune cents> <stereo spread>]
+	//   mod <pitch|amplitude> lfo <sine|square|triangle|saw> <hz> <depth> [free]
+	//   mod <pitch|amplitude> envelope <attack> <decay> <sustain> <release> <depth>
+	//   mod param <parameter> lfo <sine|square|triangle|saw> <hz> <depth>
+	//
+	// "tuning" picks the pitch table the layers are transposed on, equal temperament unless set.
+	// "noise" colours every noise layer of a voice, white unless set; the transpose of a noise layer is ignored.
+	// "hz" replaces the note pitch with a fixed frequency, "reverse" runs the layer on (on - time) instead of (time - on).
+	// "unison" turns a saw layer into a stack of band limited saws (Unison.h); "harmonics" does not apply to it.
+	// "mod" routes an LFO (key synced unless "free") or an envelope to every layer's pitch, depth in semitones, or to
+	// the voice gain, scaled by 1 + depth * source. "mod param" adds depth * LFO, free running, to a parameter of the
+	// engine (Parameters.h); a name without a '.' is one of this patch's own, e.g. "volume". The parameter has to
+	// exist when the patch loads.
+
+	const int OP_SINE = 0;
+	const int OP_SQUARE = 1;
+	const int OP_TRIANGLE = 2;
+	const int OP_SAW = 3;
+	const int OP_NOISE = 4;
+
+	const int OP_FLAG_LFO = 1;
+	const int OP_FLAG_FIXED = 2;
+	const int OP_FLAG_REVERSE = 4;
+	const int OP_FLAG_UNISON = 8;
+
+	const int PATCH_UNISON_NOTES = 32;         // notes with unison stacks of their own, per patch
+	const unsigned int PATCH_BLOCK = 64;       // samples the op list runs over at a time
+
+	struct PatchLayer {
+		int waveform;
+		int transpose;
+		I_FREQ_TYPE gain;
+		I_FREQ_TYPE lfoHertz;
+		I_FREQ_TYPE lfoAmplitude;
+		I_FREQ_TYPE harmonics;
+		I_FREQ_TYPE fixedHertz;
+		bool fixed;
+		bool reverse;
+		UnisonSettings unison;
+		bool stacked;
+
+		PatchLayer() {
+			waveform = SINE_WAVE;
+			transpose = 0;
+			gain = 1.0;
+			lfoHertz = 0.0;
+			lfoAmplitude = 0.0;
+			harmonics = 50.0;
+			fixedHertz = 0.0;
+			fixed = false;
+			reverse = false;
+			stacked = false;
+		}
+	};
+
+	struct PatchRoute {
+		int target;
+		bool envelope;
+		ModLfo lfo;
+		EnvelopeADSR envelopeShape;
+		I_FREQ_TYPE depth;
+		string parameter; // "mod param" routes only
+
+		PatchRoute() {
+			target = MOD_PITCH;
+			envelope = false;
+			depth = 0.0;
+		}
+	};
+
+	struct Patch {
+		wstring name;
+		I_FREQ_TYPE volume;
+		I_FREQ_TYPE maxLifeTime;
+		bool finishOnLifetime;
+		const PitchTable* tuning;
+		NoiseShape noise;
+		EnvelopeADSR envelope;
+		vector<PatchLayer> layers;
+		vector<PatchRoute> routes;
+
+		Patch() {
+			name = L"Patch";
+			volume = 1.0;
+			maxLifeTime = -1.0;
+			finishOnLifetime = false;
+			tuning = &EQUAL_TEMPERAMENT;
+		}
+	};
+
+	// One compiled layer. Everything that does not depend on the note is resolved here so the
+	// interpreter only has to pick up the note pitch and run the waveform kernel.
+	struct PatchOp {
+		int opcode;
+		int flags;
+		int transpose;
+		I_FREQ_TYPE gain;
+		I_FREQ_TYPE fixedHertz;
+		ModLfo lfo;
+		I_FREQ_TYPE lfoAmplitude;
+		I_FREQ_TYPE harmonics;
+		UnisonSettings unison;
+		int stack; // index among the patch's unison layers
+	};
+
+	static bool ParseWaveform(const string& token, int& waveform) {
+		if (token == "sine") waveform = SINE_WAVE;
+		else if (token == "square") waveform = SQUARE_WAVE;
+		else if (token == "triangle") waveform = TRIANGLE_WAVE;
+		else if (token == "saw") waveform = SAW_WAVE;
+		else if (token == "noise") waveform = NOISE;
+		else return false;
+		return true;
+	}
+
+	static bool ParseLayer(istringstream& line, PatchLayer& layer) {
+		string waveform;
+		if (!(line >> waveform >> layer.transpose >> layer.gain) || !ParseWaveform(waveform, layer.waveform))
+			return false;
+
+		string option;
+		while (line >> option) {
+			if (option == "lfo") {
+				if (!(line >> layer.lfoHertz >> layer.lfoAmplitude)) return false;
+			}
+			else if (option == "harmonics") {
+				if (!(line >> layer.harmonics)) return false;
+			}
+			else if (option == "hz") {
+				if (!(line >> layer.fixedHertz)) return false;
+				layer.fixed = true;
+			}
+			else if (option == "reverse") {
+				layer.reverse = true;
+			}
+			else if (option == "unison") {
+				if (!(line >> layer.unison.voices >> layer.unison.detune >> layer.unison.stereoSpread)) return false;
+				layer.stacked = true;
+			}
+			else {
+				return false;
+			}
+		}
+		return !layer.stacked || layer.waveform == SAW_WAVE;
+	}
+
+	static bool ParseRoute(istringstream& line, PatchRoute& route) {
+		string target, source;
+		if (!(line >> target >> source))
+			return false;
+
+		if (target == "param") {
+			route.parameter = source;
+			if (!(line >> source) || source != "lfo")
+				return false;
+			route.lfo.keySync = false;
+		}
+		else if (target == "pitch") route.target = MOD_PITCH;
+		else if (target == "amplitude") route.target = MOD_AMPLITUDE;
+		else return false;
+
+		if (source == "envelope") {
+			route.envelope = true;
+			EnvelopeADSR& envelope = route.envelopeShape;
+			return (bool)(line >> envelope.attackTime >> envelope.decayTime >> envelope.sustainTime >> envelope.releaseTime >> route.depth);
+		}
+
+		string shape;
+		if (source != "lfo" || !(line >> shape >> route.lfo.hertz >> route.depth) || !ParseWaveform(shape, route.lfo.shape) || route.lfo.shape == NOISE)
+			return false;
+
+		string option;
+		if (line >> option) {
+			if (option != "free" || !route.parameter.empty())
+				return false;
+			route.lfo.keySync = false;
+		}
+		return true;
+	}
+
+	// Parses a patch from text. Returns false and leaves the line number in errorLine on a malformed statement.
+	bool ParsePatch(istream& input, Patch& patch, int& errorLine) {
+		string text;
+		errorLine = 0;
+
+		while (getline(input, text)) {
+			errorLine++;
+
+			size_t comment = text.find('#');
+			if (comment != string::npos)
+				text.erase(comment);
+
+			istringstream line(text);
+			string keyword;
+			if (!(line >> keyword))
+				continue;
+
+			bool ok = true;
+			if (keyword == "name") {
+				string name;
+				getline(line >> ws, name);
+				patch.name = wstring(name.begin(), name.end());
+			}
+			else if (keyword == "volume")
+				ok = (bool)(line >> patch.volume);
+			else if (keyword == "maxlife")
+				ok = (bool)(line >> patch.maxLifeTime);
+			else if (keyword == "envelope")
+				ok = (bool)(line >> patch.envelope.attackTime >> patch.envelope.decayTime >> patch.envelope.sustainTime >> patch.envelope.releaseTime);
+			else if (keyword == "finish") {
+				string mode;
+				ok = (bool)(line >> mode) && (mode == "envelope" || mode == "lifetime");
+				patch.finishOnLifetime = mode == "lifetime";
+			}
+			else if (keyword == "tuning") {
+				string mode;
+				ok = (bool)(line >> mode) && (mode == "equal" || mode == "just");
+				patch.tuning = mode == "just" ? &JUST_INTONATION : &EQUAL_TEMPERAMENT;
+			}
+			else if (keyword == "noise") {
+				string color;
+				ok = (bool)(line >> color);
+				if (color == "white")
+					patch.noise.color = NOISE_COLOR_WHITE;
+				else if (color == "pink")
+					patch.noise.color = NOISE_COLOR_PINK;
+				else if (color == "band") {
+					patch.noise.color = NOISE_COLOR_BAND;
+					ok = (bool)(line >> patch.noise.hertz >> patch.noise.q) && patch.noise.hertz > 0.0 && patch.noise.q > 0.0;
+				}
+				else
+					ok = false;
+			}
+			else if (keyword == "osc") {
+				PatchLayer layer;
+				ok = ParseLayer(line, layer);
+				patch.layers.push_back(layer);
+			}
+			else if (keyword == "mod") {
+				PatchRoute route;
+				ok = ParseRoute(line, route);
+				patch.routes.push_back(route);
+			}
+			else
+				ok = false;
+
+			if (!ok)
+				return false;
+		}
+
+		errorLine = 0;
+		return true;
+	}
+
+	vector<PatchOp> CompilePatch(const Patch& patch) {
+		vector<PatchOp> ops;
+		ops.reserve(patch.layers.size());
+		int stacks = 0;
+
+		for (const PatchLayer& layer : patch.layers) {
+			PatchOp op;
+			op.opcode = layer.waveform;
+			op.flags = 0;
+			op.transpose = layer.transpose;
+			op.gain = layer.gain;
+			op.fixedHertz = layer.fixedHertz;
+			op.lfo = ModLfo(layer.lfoHertz);
+			op.lfoAmplitude = layer.lfoAmplitude;
+			op.harmonics = layer.harmonics;
+			op.unison = layer.unison;
+			op.unison.gain = layer.reverse ? -1.0 : 1.0; // a reversed saw rises
+			op.stack = layer.stacked ? stacks++ : -1;
+
+			if (layer.lfoAmplitude != 0.0) op.flags |= OP_FLAG_LFO;
+			if (layer.fixed) op.flags |= OP_FLAG_FIXED;
+			if (layer.reverse) op.flags |= OP_FLAG_REVERSE;
+			if (layer.stacked) op.flags |= OP_FLAG_UNISON;
+
+			ops.push_back(op);
+		}
+
+		return ops;
+	}
+
+	// Instrument driven by a compiled patch. The op list is contiguous and small and runs a block at a time,
+	// so the interpreter stays in cache and skips the LFO term entirely for layers that have none.
+	struct PatchInstrument : public BaseInstrument {
+		vector<PatchOp> ops;
+		vector<PatchRoute> routes;
+		bool finishOnLifetime;
+
+		PatchInstrument() {
+			volume = 1.0;
+			maxLifeTme = -1.0;
+			finishOnLifetime = false;
+			name = L"Patch";
+			m_stackCount = 0;
+			m_refused = 0;
+		}
+
+		void Load(const Patch& patch) {
+			name = patch.name;
+			volume = patch.volume;
+			maxLifeTme = patch.maxLifeTime;
+			finishOnLifetime = patch.finishOnLifetime;
+			envelopeOutput = patch.envelope;
+			tuning = patch.tuning;
+			ops = CompilePatch(patch);
+
+			// Voices only get a noise stream when a layer plays it
+			noise = patch.noise;
+			bool noisy = any_of(ops.begin(), ops.end(), [](const PatchOp& op) { return op.opcode == OP_NOISE; });
+			if (!noisy)
+				noise.color = NOISE_COLOR_NONE;
+			else if (noise.color == NOISE_COLOR_NONE)
+				noise.color = NOISE_COLOR_WHITE;
+			routes = patch.routes;
+
+			// Every note slot gets one stack per unison layer, allocated here rather than on the audio thread
+			m_stackCount = (int)count_if(ops.begin(), ops.end(), [](const PatchOp& op) { return (op.flags & OP_FLAG_UNISON) != 0; });
+			m_stacks.assign(m_stackCount > 0 ? PATCH_UNISON_NOTES * m_stackCount : 0, UnisonOscillator());
+			m_used.assign(m_stackCount > 0 ? PATCH_UNISON_NOTES : 0, false);
+		}
+
+		// One layer per op, in order, up to VOICE_LAYERS
+		virtual void Prepare(synthesizer::Note& n) const {
+			n.record.Reset(envelopeOutput);
+			for (const PatchOp& op : ops)
+				n.record.AddLayer(OpHertz(op, n), op.gain);
+		}
+
+		virtual void NoteStarted(synthesizer::Note& n) {
+			n.voice = -1;
+			for (size_t slot = 0; slot < m_used.size(); slot++)
+				if (!m_used[slot]) {
+					m_used[slot] = true;
+					for (const PatchOp& op : ops)
+						if (op.flags & OP_FLAG_UNISON)
+							StartStack(m_stacks[slot * m_stackCount + op.stack], op, n);
+					n.voice = (int)slot;
+					return;
+				}
+
+			// Only a patch with unison layers keeps per-note state
+			if (!m_used.empty()) {
+				n.voice = VOICE_REFUSED;
+				m_refused++;
+			}
+		}
+
+		virtual void NoteStopped(synthesizer::Note& n) {
+			if (n.voice >= 0)
+				m_used[n.voice] = false;
+			n.voice = -1;
+		}
+
+		// Shares the layer LFOs with every other instrument of the engine and adds the patch's routes. 'prefix'
+		// names this patch's own parameters in the bank. Call it once, while setting up, after the parameters
+		// are registered.
+		bool BindModulation(ModulationEngine& modulation, const ParameterBank& parameters, const string& prefix) {
+			bool bound = true;
+			for (PatchOp& op : ops)
+				if (op.flags & OP_FLAG_LFO)
+					bound = modulation.BindLfo(this, op.lfo) && bound;
+
+			for (const PatchRoute& route : routes) {
+				int source = route.envelope ? modulation.AddEnvelope(route.envelopeShape) : modulation.AddLfo(route.lfo);
+				if (route.parameter.empty()) {
+					bound = modulation.AddRoute(this, source, route.target, route.depth) && bound;
+					continue;
+				}
+
+				string name = route.parameter.find('.') == string::npos ? prefix + "." + route.parameter : route.parameter;
+				bound = modulation.AddParameterRoute(source, parameters.Find(name), route.depth) && bound;
+			}
+			return bound;
+		}
+
+		virtual unsigned long long ParameterHash() const {
+			unsigned long long hash = BaseInstrument::ParameterHash();
+			hash = HashBytes(&finishOnLifetime, sizeof(finishOnLifetime), hash);
+			for (const PatchOp& op : ops) {
+				int header[] = { op.opcode, op.flags, op.transpose };
+				I_FREQ_TYPE values[] = { op.gain, op.fixedHertz, op.lfo.hertz, op.lfoAmplitude, op.harmonics,
+					(I_FREQ_TYPE)op.unison.voices, op.unison.detune, op.unison.stereoSpread };
+				hash = HashBytes(header, sizeof(header), hash);
+				hash = HashBytes(values, sizeof(values), hash);
+			}
+			return hash;
+		}
+
+		virtual I_FREQ_TYPE sound(const I_FREQ_TYPE time, const synthesizer::Note& n, bool& noteFinished) {
+			I_FREQ_TYPE sample = 0.0;
+			RenderBlock(n, &time, 1, &sample, noteFinished);
+			return sample;
+		}
+
+		// Runs the op list once per PATCH_BLOCK samples: each op fills the block in a loop of its own, so the
+		// dispatch is paid per block and the sine loops have no branches in them
+		virtual unsigned int RenderBlock(const synthesizer::Note& n, const I_FREQ_TYPE* times, const unsigned int frames,
+			I_FREQ_TYPE* samples, bool& noteFinished) {
+			// A note that found every unison slot taken ends right away
+			if (n.voice == VOICE_REFUSED) {
+				samples[0] = 0.0;
+				noteFinished = true;
+				return 1;
+			}
+
+			for (unsigned int first = 0; first < frames; first += PATCH_BLOCK) {
+				unsigned int count = min(frames - first, PATCH_BLOCK);
+				unsigned int played = RenderOps(n, times + first, count, samples + first, noteFinished);
+				if (noteFinished)
+					return first + played;
+			}
+			return frames;
+		}
+
+		// Notes refused because all PATCH_UNISON_NOTES slots were taken
+		unsigned long long RefusedNotes() const {
+			return m_refused;
+		}
+
+	private:
+		unsigned int RenderOps(const synthesizer::Note& n, const I_FREQ_TYPE* times, const unsigned int frames,
+			I_FREQ_TYPE* samples, bool& noteFinished) {
+			const VoiceRecord& voice = n.record;
+			I_FREQ_TYPE amplitude[PATCH_BLOCK];
+			I_FREQ_TYPE pitch[PATCH_BLOCK];
+			I_FREQ_TYPE phase[PATCH_BLOCK];
+
+			// The envelope first, so the ops render only the samples the note plays
+			unsigned int played = frames;
+			for (unsigned int i = 0; i < played; i++) {
+				I_FREQ_TYPE time = times[i];
+				amplitude[i] = voice.envelope.amplitude(time, n.on, n.off);
+
+				if (finishOnLifetime) {
+					if (maxLifeTme > 0.0 && time - n.on >= maxLifeTme) noteFinished = true;
+				}
+				else if (synthesizer::envelopeFinished(amplitude[i], time, voice.envelope, n))
+					noteFinished = true;
+
+				if (noteFinished)
+					played = i + 1;
+			}
+
+			for (unsigned int i = 0; i < played; i++) {
+				pitch[i] = ModulationTarget(n, MOD_PITCH, times[i]);
+				samples[i] = 0.0;
+			}
+
+			const PatchOp* op = ops.data();
+			const PatchOp* end = op + ops.size();
+
+			for (int layer = 0; op != end; ++op, ++layer) {
+				bool recorded = layer < voice.layers;
+				I_FREQ_TYPE gain = recorded ? voice.gain[layer] : op->gain;
+
+				if (op->flags & OP_FLAG_UNISON) {
+					for (unsigned int i = 0; i < played; i++)
+						samples[i] += gain * Stacked(*op, n, times[i], pitch[i]);
+					continue;
+				}
+
+				I_FREQ_TYPE hertz = recorded ? voice.hertz[layer] : OpHertz(*op, n);
+				I_FREQ_TYPE angular = recorded ? voice.angular[layer] : ConvertToHz(hertz);
+				bool reverse = (op->flags & OP_FLAG_REVERSE) != 0;
+				for (unsigned int i = 0; i < played; i++) {
+					I_FREQ_TYPE lifeTime = reverse ? n.on - times[i] : times[i] - n.on;
+					phase[i] = angular * lifeTime + pitch[i] * hertz;
+				}
+
+				// The shared LFO runs forwards from the note on; a reversed layer reads it backwards, the sine is odd
+				if (op->flags & OP_FLAG_LFO) {
+					I_FREQ_TYPE depth = op->lfoAmplitude * hertz;
+					for (unsigned int i = 0; i < played; i++) {
+						I_FREQ_TYPE lfo = LfoValue(op->lfo, n, times[i]);
+						phase[i] += depth * (reverse ? -lfo : lfo);
+					}
+				}
+
+				switch (op->opcode) {
+				case OP_SINE:
+					for (unsigned int i = 0; i < played; i++)
+						samples[i] += gain * sin(phase[i]);
+					break;
+
+				case OP_SQUARE:
+					for (unsigned int i = 0; i < played; i++)
+						samples[i] += gain * (sin(phase[i]) > 0 ? 1.0 : -1.0);
+					break;
+
+				case OP_TRIANGLE:
+					for (unsigned int i = 0; i < played; i++)
+						samples[i] += gain * (asin(sin(phase[i])) * (2.0 / PI));
+					break;
+
+				case OP_SAW:
+					for (unsigned int i = 0; i < played; i++) {
+						I_FREQ_TYPE output = 0.0;
+						for (I_FREQ_TYPE h = 1.0; h < op->harmonics; h++)
+							output += sin(h * phase[i]) / h;
+						samples[i] += gain * (output * (2.0 / PI));
+					}
+					break;
+
+				case OP_NOISE:
+					for (unsigned int i = 0; i < played; i++)
+						samples[i] += gain * VoiceNoise(n, times[i]);
+					break;
+				}
+			}
+
+			for (unsigned int i = 0; i < played; i++)
+				samples[i] = amplitude[i] * samples[i] * volume;
+			return played;
+		}
+
+		I_FREQ_TYPE OpHertz(const PatchOp& op, const synthesizer::Note& n) const {
+			return (op.flags & OP_FLAG_FIXED) ? op.fixedHertz : synthesizer::Scale(n.id + op.transpose, *tuning);
+		}
+
+		void StartStack(UnisonOscillator& stack, const PatchOp& op, const synthesizer::Note& n) {
+			stack.Start(OpHertz(op, n), n.on, op.unison);
+		}
+
+		// A unison layer, folded to mono. The stack always runs forwards, a reversed layer is a rising saw with
+		// the same vibrato, so the LFO keeps its sign here.
+		I_FREQ_TYPE Stacked(const PatchOp& op, const synthesizer::Note& n, I_FREQ_TYPE time, I_FREQ_TYPE pitch) {
+			I_FREQ_TYPE modulation = pitch;
+			if (op.flags & OP_FLAG_LFO)
+				modulation += op.lfoAmplitude * LfoValue(op.lfo, n, time);
+
+			I_FREQ_TYPE left, right;
+			m_stacks[n.voice * m_stackCount + op.stack].Render(time, modulation, left, right);
+			return (left + right) * sqrt(0.5);
+		}
+
+		int m_stackCount;
+		vector<UnisonOscillator> m_stacks;
+		vector<bool> m_used;
+		atomic<unsigned long long> m_refused;
+	};
+
+	bool LoadPatch(const string& path, PatchInstrument& instrument) {
+		ifstream file(path);
+		if (!file.is_open())
+			return false;
+
+		Patch patch;
+		int errorLine = 0;
+		if (!ParsePatch(file, patch, errorLine)) {
+			cerr << path << ":" << errorLine << ": malformed patch statement" << endl;
+			return false;
+		}
+
+		instrument.Load(patch);
+		return true;
+	}
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#pragma comment(lib, "avrt.lib")
+
+#include <string>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <xmmintrin.h>
+using namespace std;
+
+#include <Windows.h>
+#include <avrt.h>
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	******************************************** REALTIME PROFILE **************************************************
+	****************************************************************************************************************/
+
+	// Scheduling and memory settings for the render thread. Every part is best effort: whatever the system
+	// refuses falls back to the next best setting and shows up in the report.
+	struct RealtimeProfile {
+		bool enabled;
+		DWORD priorityClass;        // process class, 0 leaves it alone. REALTIME needs the privilege and falls back to HIGH.
+		int threadPriority;
+		bool multimediaClass;       // register the thread with MMCSS as "Pro Audio"
+		DWORD_PTR affinityMask;     // 0 leaves the thread free to move
+		bool lockMemory;            // pre-fault and lock the audio buffers in the working set
+		bool flushDenormals;        // FTZ and DAZ on the render thread
+
+		RealtimeProfile() {
+			enabled = false;
+			priorityClass = 0;
+			threadPriority = THREAD_PRIORITY_NORMAL;
+			multimediaClass = false;
+			affinityMask = 0;
+			lockMemory = false;
+			flushDenormals = false;
+		}
+
+		// Everything on, with the render thread pinned to the last core (the UI loop tends to land on the first)
+		static RealtimeProfile Audio() {
+			RealtimeProfile profile;
+			profile.enabled = true;
+			profile.priorityClass = HIGH_PRIORITY_CLASS;
+			profile.threadPriority = THREAD_PRIORITY_TIME_CRITICAL;
+			profile.multimediaClass = true;
+			// An affinity mask only covers the thread's processor group, one bit per processor up to 64
+			unsigned int cores = min(thread::hardware_concurrency(), (unsigned int)(sizeof(DWORD_PTR) * 8));
+			profile.affinityMask = cores > 1 ? (DWORD_PTR)1 << (cores - 1) : 0;
+			profile.lockMemory = true;
+			profile.flushDenormals = true;
+			return profile;
+		}
+	};
+
+	// Touches every page, then locks the range. The working set minimum is raised first, VirtualLock fails
+	// once the locked pages no longer fit in it.
+	bool LockAudioMemory(void* memory, size_t size) {
+		if (memory == nullptr || size == 0)
+			return true;
+
+		volatile unsigned char* bytes = (volatile unsigned char*)memory;
+		for (size_t i = 0; i < size; i += 4096)
+			bytes[i] = bytes[i];
+
+		SIZE_T minimum, maximum;
+		if (GetProcessWorkingSetSize(GetCurrentProcess(), &minimum, &maximum))
+			SetProcessWorkingSetSize(GetCurrentProcess(), minimum + size + 4096, max(maximum, minimum + size + 4096));
+
+		return VirtualLock(memory, size) != 0;
+	}
+
+	// Process wide part, call it from any thread
+	string ApplyProcessProfile(const RealtimeProfile& profile) {
+		ostringstream report;
+		if (!profile.enabled || profile.priorityClass == 0)
+			return report.str();
+
+		// Without the privilege REALTIME is silently granted as HIGH, so read back what we got
+		SetPriorityClass(GetCurrentProcess(), profile.priorityClass);
+		DWORD granted = GetPriorityClass(GetCurrentProcess());
+		if (granted == REALTIME_PRIORITY_CLASS)
+			report << "class realtime";
+		else if (granted == HIGH_PRIORITY_CLASS)
+			report << (profile.priorityClass == REALTIME_PRIORITY_CLASS ? "class high (realtime refused)" : "class high");
+		else
+			report << "class unchanged";
+		return report.str();
+	}
+
+	// Thread part, must run on the render thread itself
+	string ApplyThreadProfile(const RealtimeProfile& profile) {
+		ostringstream report;
+		if (!profile.enabled)
+			return "realtime profile off";
+
+		bool scheduled = false;
+		if (profile.multimediaClass) {
+			DWORD taskIndex = 0;
+			HANDLE task = AvSetMmThreadCharacteristicsA("Pro Audio", &taskIndex);
+			if (task != NULL) {
+				AvSetMmThreadPriority(task, AVRT_PRIORITY_CRITICAL);
+				report << "mmcss pro audio";
+				scheduled = true;
+			}
+			else
+				report << "mmcss refused";
+		}
+
+		if (!scheduled) {
+			if (SetThreadPriority(GetCurrentThread(), profile.threadPriority))
+				report << (report.tellp() > 0 ? ", " : "") << "priority " << profile.threadPriority;
+			else
+				report << (report.tellp() > 0 ? ", " : "") << "priority refused";
+		}
+
+		if (profile.affinityMask != 0) {
+			if (SetThreadAffinityMask(GetCurrentThread(), profile.affinityMask) != 0)
+				report << ", affinity 0x" << hex << (unsigned long long)profile.affinityMask << dec;
+			else
+				report << ", affinity refused";
+		}
+
+		if (profile.flushDenormals) {
+			_mm_setcsr(_mm_getcsr() | 0x8040); // FTZ | DAZ
+			report << ", ftz/daz";
+		}
+
+		// Fault in the stack the render path will use before it is needed
+		if (profile.lockMemory) {
+			volatile unsigned char stack[64 * 1024];
+			for (size_t i = 0; i < sizeof(stack); i += 4096)
+				stack[i] = 0;
+		}
+
+		return report.str();
+	}
+}
@@ -0,0 +1,498 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+using namespace std;
+
+#include <Windows.h>
+#include "Synthesizer.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	******************************************** SAMPLE INSTRUMENT *************************************************
+	****************************************************************************************************************/
+
+	// Read only view of a whole file. Nothing is read until a page is touched, so opening a multi-gigabyte
+	// bank costs nothing but address space.
+	class MappedFile {
+
+	public:
+		MappedFile() {
+			m_file = INVALID_HANDLE_VALUE;
+			m_mapping = NULL;
+			m_data = nullptr;
+			m_size = 0;
+		}
+
+		~MappedFile() {
+			Close();
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool Open(const string& path) {
+			Close();
+
+			m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (m_file == INVALID_HANDLE_VALUE)
+				return false;
+
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) {
+				Close();
+				return false;
+			}
+			m_size = (size_t)size.QuadPart;
+
+			m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (m_mapping == NULL) {
+				Close();
+				return false;
+			}
+
+			m_data = (const unsigned char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+			if (m_data == nullptr) {
+				Close();
+				return false;
+			}
+			return true;
+		}
+
+		void Close() {
+			if (m_data != nullptr)
+				UnmapViewOfFile(m_data);
+			if (m_mapping != NULL)
+				CloseHandle(m_mapping);
+			if (m_file != INVALID_HANDLE_VALUE)
+				CloseHandle(m_file);
+
+			m_file = INVALID_HANDLE_VALUE;
+			m_mapping = NULL;
+			m_data = nullptr;
+			m_size = 0;
+		}
+
+		const unsigned char* Data() const { return m_data; }
+		size_t Size() const { return m_size; }
+
+	private:
+		HANDLE m_file;
+		HANDLE m_mapping;
+		const unsigned char* m_data;
+		size_t m_size;
+	};
+
+	// One mapped WAV file and the notes it plays. Only the head is copied into memory; everything after it
+	// stays on disk until a voice streams it.
+	struct SampleZone {
+		MappedFile file;
+		const unsigned char* frames;  // first frame in the mapped data chunk
+		long long frameCount;
+		int channels;
+		int bytesPerSample;
+		bool isFloat;
+		unsigned int sampleRate;
+		int rootNote;
+		int lowNote;
+		int highNote;
+		vector<float> head;           // mono copy of the first frames, enough to start a note without touching the disk
+
+		SampleZone() {
+			frames = nullptr;
+			frameCount = 0;
+			channels = 1;
+			bytesPerSample = 2;
+			isFloat = false;
+			sampleRate = 44100;
+			rootNote = 60;
+			lowNote = 0;
+			highNote = 127;
+		}
+	};
+
+	// Frame 'index' mixed down to mono, read straight from the mapped file
+	float ReadSampleFrame(const SampleZone& zone, long long index) {
+		const unsigned char* frame = zone.frames + index * zone.channels * zone.bytesPerSample;
+		float sum = 0.0f;
+
+		for (int c = 0; c < zone.channels; c++, frame += zone.bytesPerSample) {
+			switch (zone.bytesPerSample) {
+			case 2:
+				sum += (short)(frame[0] | (frame[1] << 8)) / 32768.0f;
+				break;
+
+			case 3:
+				sum += (int)((frame[0] << 8) | (frame[1] << 16) | (frame[2] << 24)) / 2147483648.0f;
+				break;
+
+			case 4:
+				if (zone.isFloat) {
+					float value;
+					memcpy(&value, frame, 4);
+					sum += value;
+				}
+				else {
+					int value;
+					memcpy(&value, frame, 4);
+					sum += value / 2147483648.0f;
+				}
+				break;
+			}
+		}
+		return sum / zone.channels;
+	}
+
+	// Maps a RIFF WAV file (16, 24 or 32 bit PCM, or 32 bit float) and points the zone at its data chunk
+	bool MapWav(const string& path, SampleZone& zone) {
+		if (!zone.file.Open(path))
+			return false;
+
+		const unsigned char* data = zone.file.Data();
+		size_t size = zone.file.Size();
+		if (size < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0)
+			return false;
+
+		bool haveFormat = false;
+		for (size_t offset = 12; offset + 8 <= size;) {
+			unsigned int chunkSize;
+			memcpy(&chunkSize, data + offset + 4, 4);
+			const unsigned char* chunk = data + offset + 8;
+			size_t available = min((size_t)chunkSize, size - offset - 8);
+
+			if (memcmp(data + offset, "fmt ", 4) == 0 && available >= 16) {
+				unsigned short format, channels, bits;
+				memcpy(&format, chunk, 2);
+				memcpy(&channels, chunk + 2, 2);
+				memcpy(&zone.sampleRate, chunk + 4, 4);
+				memcpy(&bits, chunk + 14, 2);
+
+				// WAVE_FORMAT_EXTENSIBLE keeps the real format in the first two bytes of the sub format GUID
+				if (format == 0xFFFE && available >= 26)
+					memcpy(&format, chunk + 24, 2);
+
+				zone.channels = channels;
+				zone.bytesPerSample = bits / 8;
+				zone.isFloat = format == 3;
+				haveFormat = channels > 0 && (format == 1 || (format == 3 && bits == 32)) &&
+					(zone.bytesPerSample == 2 || zone.bytesPerSample == 3 || zone.bytesPerSample == 4);
+			}
+			else if (memcmp(data + offset, "data", 4) == 0 && haveFormat) {
+				zone.frames = chunk;
+				zone.frameCount = (long long)(available / (zone.channels * zone.bytesPerSample));
+				return zone.frameCount > 0;
+			}
+
+			offset += 8 + chunkSize + (chunkSize & 1);
+		}
+		return false;
+	}
+
+	const int SAMPLE_STREAMS = 32;           // voices that can stream at once
+	const int SAMPLE_STREAM_FRAMES = 16384;  // prefetch ring per voice
+	const int SAMPLE_STREAM_CHUNK = 4096;    // frames the reader moves per visit
+
+	const int STREAM_FREE = 0;
+	const int STREAM_CLAIMED = 1;
+	const int STREAM_ACTIVE = 2;
+	const int STREAM_RELEASING = 3;
+
+	// Prefetch ring for one voice, frames [head, head + written) of its zone. The reader thread is the only
+	// writer; the audio thread only reads and advances 'consumed'. A released stream is handed back to the
+	// free list by the reader, so it is never claimed while a fill is still in flight.
+	struct SampleStream {
+		atomic<int> state;
+		const SampleZone* zone;
+		atomic<long long> written;
+		atomic<long long> consumed;
+		vector<float> ring;
+
+		SampleStream() : state(STREAM_FREE), written(0), consumed(0), ring(SAMPLE_STREAM_FRAMES) {
+			zone = nullptr;
+		}
+	};
+
+	// Plays WAV sample banks with per-note resampling. Bank format, one statement per line, '#' starts a comment:
+	//
+	//   name Piano
+	//   volume 1.0
+	//   envelope <attack> <decay> <sustain> <release>
+	//   head 0.25                               seconds of every sample kept in memory
+	//   sample <file.wav> <root note> [<low note> <high note>]
+	//
+	// Sample paths are relative to the bank file. The audio thread never reads the mapped file: a note plays
+	// its head from memory and the rest from its stream, a note that finds every stream taken is refused, and
+	// frames the reader has not delivered yet play as silence.
+	struct SampleInstrument : public BaseInstrument {
+		vector<unique_ptr<SampleZone>> zones;
+		I_FREQ_TYPE headSeconds;
+		bool directRead;              // read the file on the rendering thread instead of streaming, offline only
+
+		SampleInstrument() {
+			envelopeOutput.attackTime = 0.001;
+			envelopeOutput.decayTime = 0.0;
+			envelopeOutput.sustainTime = 1.0;
+			envelopeOutput.releaseTime = 0.2;
+			maxLifeTme = -1.0;
+			volume = 1.0;
+			headSeconds = 0.25;
+			directRead = false;
+			name = L"Sampler";
+
+			fill(m_noteZones, m_noteZones + 128, nullptr);
+			fill(m_noteRatios, m_noteRatios + 128, 1.0);
+			for (int s = 0; s < SAMPLE_STREAMS; s++)
+				m_streams[s].reset(new SampleStream());
+
+			m_underruns = 0;
+			m_refused = 0;
+			m_running = true;
+			m_reader = thread(&SampleInstrument::ReaderThread, this);
+		}
+
+		~SampleInstrument() {
+			m_running = false;
+			m_reader.join();
+		}
+
+		SampleInstrument(const SampleInstrument&) = delete;
+		SampleInstrument& operator=(const SampleInstrument&) = delete;
+
+		// Maps the file, copies its head and assigns it to its note range. Must be called before any note plays.
+		bool AddZone(const string& path, int rootNote, int lowNote, int highNote) {
+			unique_ptr<SampleZone> zone(new SampleZone());
+			if (!MapWav(path, *zone))
+				return false;
+
+			zone->rootNote = rootNote;
+			zone->lowNote = max(0, lowNote);
+			zone->highNote = min(127, highNote);
+
+			long long headFrames = min(zone->frameCount, (long long)(headSeconds * zone->sampleRate));
+			zone->head.resize((size_t)headFrames);
+			for (long long f = 0; f < headFrames; f++)
+				zone->head[(size_t)f] = ReadSampleFrame(*zone, f);
+
+			for (int note = zone->lowNote; note <= zone->highNote; note++) {
+				m_noteZones[note] = zone.get();
+				m_noteRatios[note] = pow(2.0, (note - rootNote) / 12.0);
+			}
+
+			zones.push_back(move(zone));
+			return true;
+		}
+
+		virtual void NoteStarted(Note& n) {
+			n.voice = -1;
+			if (n.id < 0 || n.id > 127 || m_noteZones[n.id] == nullptr || directRead)
+				return;
+
+			// A sample that fits in its head needs no stream
+			const SampleZone* zone = m_noteZones[n.id];
+			if (zone->frameCount <= (long long)zone->head.size())
+				return;
+
+			for (int s = 0; s < SAMPLE_STREAMS; s++) {
+				SampleStream& stream = *m_streams[s];
+				int expected = STREAM_FREE;
+				if (!stream.state.compare_exchange_strong(expected, STREAM_CLAIMED))
+					continue;
+
+				stream.zone = m_noteZones[n.id];
+				stream.written.store(0);
+				stream.consumed.store(0);
+				stream.state.store(STREAM_ACTIVE, memory_order_release);
+				n.voice = s;
+				return;
+			}
+
+			n.voice = VOICE_REFUSED;
+			m_refused++;
+		}
+
+		virtual void NoteStopped(Note& n) {
+			if (n.voice >= 0)
+				m_streams[n.voice]->state.store(STREAM_RELEASING, memory_order_release);
+			n.voice = -1;
+		}
+
+		virtual I_FREQ_TYPE sound(const I_FREQ_TYPE time, const synthesizer::Note& n, bool& noteFinished) {
+			I_FREQ_TYPE amplitude = n.record.envelope.amplitude(time, n.on, n.off);
+			if (synthesizer::envelopeFinished(amplitude, time, n.record.envelope, n)) noteFinished = true;
+
+			const SampleZone* zone = n.id >= 0 && n.id <= 127 ? m_noteZones[n.id] : nullptr;
+			if (zone == nullptr || n.voice == VOICE_REFUSED) {
+				noteFinished = true;
+				return 0.0;
+			}
+
+			I_FREQ_TYPE position = (time - n.on) * zone->sampleRate * m_noteRatios[n.id];
+			long long index = (long long)position;
+			if (index >= zone->frameCount) {
+				noteFinished = true;
+				return 0.0;
+			}
+
+			// 4 point Hermite interpolation
+			I_FREQ_TYPE t = position - index;
+			I_FREQ_TYPE y0 = Frame(*zone, n.voice, index - 1);
+			I_FREQ_TYPE y1 = Frame(*zone, n.voice, index);
+			I_FREQ_TYPE y2 = Frame(*zone, n.voice, index + 1);
+			I_FREQ_TYPE y3 = Frame(*zone, n.voice, index + 2);
+
+			I_FREQ_TYPE c1 = 0.5 * (y2 - y0);
+			I_FREQ_TYPE c2 = y0 - 2.5 * y1 + 2.0 * y2 - 0.5 * y3;
+			I_FREQ_TYPE c3 = 0.5 * (y3 - y0) + 1.5 * (y1 - y2);
+			I_FREQ_TYPE sample = ((c3 * t + c2) * t + c1) * t + y1;
+
+			// Everything before the oldest frame the interpolator needs can be overwritten
+			if (n.voice >= 0)
+				m_streams[n.voice]->consumed.store(max(0LL, index - 1 - (long long)zone->head.size()), memory_order_release);
+
+			return amplitude * sample * volume;
+		}
+
+		// Frames a voice played as silence because the reader had not delivered them yet
+		unsigned long long Underruns() const {
+			return m_underruns;
+		}
+
+		// Notes refused because every stream was taken
+		unsigned long long RefusedNotes() const {
+			return m_refused;
+		}
+
+	private:
+		I_FREQ_TYPE Frame(const SampleZone& zone, int voice, long long index) {
+			if (index < 0 || index >= zone.frameCount)
+				return 0.0;
+			if (index < (long long)zone.head.size())
+				return zone.head[(size_t)index];
+
+			if (directRead)
+				return ReadSampleFrame(zone, index);
+
+			long long offset = index - (long long)zone.head.size();
+			if (voice >= 0) {
+				const SampleStream& stream = *m_streams[voice];
+				if (stream.zone == &zone && offset < stream.written.load(memory_order_acquire))
+					return stream.ring[(size_t)(offset % SAMPLE_STREAM_FRAMES)];
+			}
+
+			m_underruns++;
+			return 0.0;
+		}
+
+		void ReaderThread() {
+			while (m_running) {
+				bool busy = false;
+
+				for (int s = 0; s < SAMPLE_STREAMS; s++) {
+					SampleStream& stream = *m_streams[s];
+					int state = stream.state.load(memory_order_acquire);
+
+					if (state == STREAM_RELEASING) {
+						stream.state.store(STREAM_FREE, memory_order_release);
+						continue;
+					}
+					if (state != STREAM_ACTIVE)
+						continue;
+
+					const SampleZone& zone = *stream.zone;
+					long long head = (long long)zone.head.size();
+					long long written = stream.written.load(memory_order_relaxed);
+					long long space = SAMPLE_STREAM_FRAMES - (written - stream.consumed.load(memory_order_acquire));
+					long long frames = min(min((long long)SAMPLE_STREAM_CHUNK, space), zone.frameCount - head - written);
+					if (frames <= 0)
+						continue;
+
+					for (long long f = 0; f < frames; f++)
+						stream.ring[(size_t)((written + f) % SAMPLE_STREAM_FRAMES)] = ReadSampleFrame(zone, head + written + f);
+					stream.written.store(written + frames, memory_order_release);
+					busy = true;
+				}
+
+				if (!busy)
+					this_thread::sleep_for(chrono::milliseconds(2));
+			}
+		}
+
+		const SampleZone* m_noteZones[128];
+		I_FREQ_TYPE m_noteRatios[128];
+		unique_ptr<SampleStream> m_streams[SAMPLE_STREAMS];
+
+		atomic<unsigned long long> m_underruns;
+		atomic<unsigned long long> m_refused;
+		atomic<bool> m_running;
+		thread m_reader;
+	};
+
+	static string DirectoryOf(const string& path) {
+		size_t slash = path.find_last_of("/\\");
+		return slash == string::npos ? string() : path.substr(0, slash + 1);
+	}
+
+	bool LoadSampleBank(const string& path, SampleInstrument& instrument) {
+		ifstream file(path);
+		if (!file.is_open())
+			return false;
+
+		string text;
+		int lineNumber = 0;
+		while (getline(file, text)) {
+			lineNumber++;
+			size_t comment = text.find('#');
+			if (comment != string::npos)
+				text.erase(comment);
+
+			istringstream line(text);
+			string keyword;
+			if (!(line >> keyword))
+				continue;
+
+			bool ok = true;
+			if (keyword == "name") {
+				string name;
+				getline(line >> ws, name);
+				instrument.name = wstring(name.begin(), name.end());
+			}
+			else if (keyword == "volume")
+				ok = (bool)(line >> instrument.volume);
+			else if (keyword == "envelope")
+				ok = (bool)(line >> instrument.envelopeOutput.attackTime >> instrument.envelopeOutput.decayTime
+					>> instrument.envelopeOutput.sustainTime >> instrument.envelopeOutput.releaseTime);
+			else if (keyword == "head")
+				ok = (bool)(line >> instrument.headSeconds);
+			else if (keyword == "sample") {
+				string sample;
+				int root = 60, low = 0, high = 127;
+				ok = (bool)(line >> sample >> root);
+				if (ok && line >> low)
+					ok = (bool)(line >> high);
+
+				if (ok && !instrument.AddZone(DirectoryOf(path) + sample, root, low, high)) {
+					cerr << path << ":" << lineNumber << ": cannot map " << sample << endl;
+					return false;
+				}
+			}
+			else
+				ok = false;
+
+			if (!ok) {
+				cerr << path << ":" << lineNumber << ": malformed bank statement" << endl;
+				return false;
+			}
+		}
+		return !instrument.zones.empty();
+	}
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+using namespace std;
+
+#include "OscilatorThread.h"
+#include "AudioTap.h"
+#include "Fft.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	********************************************** SCOPE VIEW ******************************************************
+	****************************************************************************************************************/
+
+	// Meters, oscilloscope and spectrum of the tapped output, drawn as text. Everything runs on the thread that
+	// calls Update, at most framesPerSecond times a second; the render thread only fills the tap.
+
+	const unsigned int SCOPE_HISTORY = 2048;      // samples kept for the scope and the FFT, a power of two
+	const I_FREQ_TYPE SCOPE_FLOOR_DB = -72.0;     // bottom of the meters and the spectrum
+	const I_FREQ_TYPE SCOPE_PEAK_HOLD = 1.5;      // seconds a peak or a clip stays on screen
+
+	class ScopeView {
+
+	public:
+		ScopeView(const AudioTap& tap, unsigned int sampleRate, I_FREQ_TYPE framesPerSecond = 30.0)
+			: m_tap(tap), m_history(SCOPE_HISTORY, 0.0) {
+			m_sampleRate = sampleRate;
+			m_frameInterval = chrono::duration<double>(1.0 / framesPerSecond);
+			m_position = tap.Head();
+			m_write = 0;
+			m_peak = 0.0;
+			m_rms = 0.0;
+			m_heldPeak = 0.0;
+			m_heldFor = 0.0;
+			m_clips = 0;
+			m_clipsShown = 0.0;
+			m_lost = 0;
+		}
+
+		// Reads what the render thread tapped since the last frame and recomputes the view. Returns false when
+		// the frame is not due yet.
+		bool Update() {
+			chrono::steady_clock::time_point now = chrono::steady_clock::now();
+			if (now - m_lastFrame < m_frameInterval)
+				return false;
+			m_lastFrame = now;
+
+			I_FREQ_TYPE peak = 0.0;
+			I_FREQ_TYPE sum = 0.0;
+			unsigned long long count = 0;
+			unsigned long long clips = 0;
+
+			m_lost += m_tap.Read(m_position, m_scratch, [&](const I_FREQ_TYPE* samples, unsigned int frames, unsigned int channels) {
+				for (unsigned int f = 0; f < frames; f++) {
+					I_FREQ_TYPE sample = samples[f * channels]; // the channels carry the same mono mix
+					peak = max(peak, fabs(sample));
+					sum += sample * sample;
+					if (fabs(sample) > 1.0)
+						clips++;
+					m_history[m_write++ % SCOPE_HISTORY] = sample;
+				}
+				count += frames;
+			});
+
+			I_FREQ_TYPE elapsed = (I_FREQ_TYPE)count / m_sampleRate;
+			m_peak = peak;
+			m_rms = count > 0 ? sqrt(sum / count) : 0.0;
+			m_clips += clips;
+
+			m_heldFor += elapsed;
+			if (peak >= m_heldPeak || m_heldFor > SCOPE_PEAK_HOLD) {
+				m_heldPeak = peak;
+				m_heldFor = 0.0;
+			}
+			m_clipsShown = clips > 0 ? SCOPE_PEAK_HOLD : max(0.0, m_clipsShown - elapsed);
+
+			vector<I_FREQ_TYPE> window(SCOPE_HISTORY);
+			for (unsigned int i = 0; i < SCOPE_HISTORY; i++)
+				window[i] = m_history[(m_write + i) % SCOPE_HISTORY];
+			m_window.swap(window);
+			MagnitudeSpectrum(m_window.data(), SCOPE_HISTORY, m_magnitudes);
+			return true;
+		}
+
+		I_FREQ_TYPE Peak() const { return m_peak; }
+		I_FREQ_TYPE Rms() const { return m_rms; }
+		unsigned long long Clips() const { return m_clips; }
+		unsigned long long LostBlocks() const { return m_lost; }
+
+		// Draws into a text buffer of 'stride' columns: two meter rows, then the scope over the top half of what
+		// is left and the spectrum under it
+		void Draw(wchar_t* screen, int stride, int x, int y, int width, int height) const {
+			auto put = [screen, stride](int column, int row, const wstring& text) {
+				for (size_t i = 0; i < text.size(); i++)
+					screen[row * stride + column + i] = text[i];
+			};
+
+			wostringstream levels;
+			levels << fixed << setprecision(1) << L"peak " << setw(5) << Decibels(m_heldPeak) << L" dB  rms "
+				<< setw(5) << Decibels(m_rms) << L" dB  clips " << m_clips << (m_clipsShown > 0.0 ? L" CLIP" : L"");
+			put(x, y, levels.str().substr(0, width));
+			put(x, y + 1, Meter(m_peak, m_heldPeak, width));
+
+			int scopeHeight = (height - 2) / 2;
+			DrawScope(screen, stride, x, y + 2, width, scopeHeight);
+			DrawSpectrum(screen, stride, x, y + 2 + scopeHeight, width, height - 2 - scopeHeight);
+		}
+
+	private:
+		static I_FREQ_TYPE Decibels(I_FREQ_TYPE level) {
+			return max(SCOPE_FLOOR_DB, 20.0 * log10(max(level, 1e-9)));
+		}
+
+		// |=====---   !| : the level as '=', the held peak as '!', full scale at the right edge
+		static wstring Meter(I_FREQ_TYPE level, I_FREQ_TYPE held, int width) {
+			int inside = max(1, width - 2);
+			auto column = [inside](I_FREQ_TYPE value) {
+				return min(inside - 1, (int)((1.0 - Decibels(value) / SCOPE_FLOOR_DB) * (inside - 1) + 0.5));
+			};
+
+			wstring meter(inside, L' ');
+			if (level > 0.0)
+				fill(meter.begin(), meter.begin() + column(level) + 1, L'=');
+			if (held > 0.0)
+				meter[column(held)] = held > 1.0 ? L'X' : L'!';
+			return L"|" + meter + L"|";
+		}
+
+		// Starts on a rising zero crossing so a steady tone stands still, each column spans a few samples and
+		// shows their range
+		void DrawScope(wchar_t* screen, int stride, int x, int y, int width, int height) const {
+			if (height < 2 || m_window.empty())
+				return;
+
+			const unsigned int span = SCOPE_HISTORY / 2;
+			unsigned int start = 0;
+			for (unsigned int i = 1; i < SCOPE_HISTORY - span; i++)
+				if (m_window[i - 1] < 0.0 && m_window[i] >= 0.0) {
+					start = i;
+					break;
+				}
+
+			auto row = [height](I_FREQ_TYPE sample) {
+				I_FREQ_TYPE clamped = max(-1.0, min(sample, 1.0));
+				return (int)((1.0 - clamped) * 0.5 * (height - 1) + 0.5);
+			};
+
+			for (int c = 0; c < width; c++) {
+				screen[(y + height / 2) * stride + x + c] = L'-';
+
+				unsigned int from = start + c * span / width;
+				unsigned int to = max(from + 1, start + (c + 1) * span / width);
+				I_FREQ_TYPE low = m_window[from];
+				I_FREQ_TYPE high = m_window[from];
+				for (unsigned int i = from; i < to; i++) {
+					low = min(low, m_window[i]);
+					high = max(high, m_window[i]);
+				}
+
+				for (int r = row(high); r <= row(low); r++)
+					screen[(y + r) * stride + x + c] = (high > 1.0 || low < -1.0) ? L'X' : L'*';
+			}
+		}
+
+		// Log frequency columns from 40 Hz to 16 kHz, dB rows down to SCOPE_FLOOR_DB
+		void DrawSpectrum(wchar_t* screen, int stride, int x, int y, int width, int height) const {
+			if (height < 1 || m_magnitudes.empty())
+				return;
+
+			const I_FREQ_TYPE lowest = 40.0;
+			const I_FREQ_TYPE highest = min(16000.0, m_sampleRate / 2.0);
+			const I_FREQ_TYPE binHertz = (I_FREQ_TYPE)m_sampleRate / SCOPE_HISTORY;
+			const I_FREQ_TYPE fullScale = SCOPE_HISTORY / 4.0; // a full scale sine through the Hann window
+
+			for (int c = 0; c < width; c++) {
+				I_FREQ_TYPE fromHertz = lowest * pow(highest / lowest, (I_FREQ_TYPE)c / width);
+				I_FREQ_TYPE toHertz = lowest * pow(highest / lowest, (I_FREQ_TYPE)(c + 1) / width);
+				size_t from = min((size_t)(fromHertz / binHertz), m_magnitudes.size() - 1);
+				size_t to = min(max(from + 1, (size_t)(toHertz / binHertz)), m_magnitudes.size());
+
+				I_FREQ_TYPE magnitude = 0.0;
+				for (size_t b = from; b < to; b++)
+					magnitude = max(magnitude, m_magnitudes[b]);
+
+				I_FREQ_TYPE level = 1.0 - Decibels(magnitude / fullScale) / SCOPE_FLOOR_DB;
+				int bar = min(height, (int)(level * height + 0.5));
+				for (int r = 0; r < bar; r++)
+					screen[(y + height - 1 - r) * stride + x + c] = L'#';
+			}
+		}
+
+		const AudioTap& m_tap;
+		unsigned int m_sampleRate;
+		chrono::duration<double> m_frameInterval;
+		chrono::steady_clock::time_point m_lastFrame;
+		unsigned long long m_position;
+		vector<I_FREQ_TYPE> m_scratch;
+
+		vector<I_FREQ_TYPE> m_history; // ring of the latest samples
+		unsigned long long m_write;
+		vector<I_FREQ_TYPE> m_window;  // the history in order, as of the last frame
+		vector<I_FREQ_TYPE> m_magnitudes;
+
+		I_FREQ_TYPE m_peak;
+		I_FREQ_TYPE m_rms;
+		I_FREQ_TYPE m_heldPeak;
+		I_FREQ_TYPE m_heldFor;
+		unsigned long long m_clips;
+		I_FREQ_TYPE m_clipsShown;
+		unsigned long long m_lost;
+	};
+}
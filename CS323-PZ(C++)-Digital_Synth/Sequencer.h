@@ -0,0 +1,257 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <string>
+#include <bitset>
+#include <atomic>
+#include <algorithm>
+using namespace std;
+
+#include "Synthesizer.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	********************************************** SEQUENCER *******************************************************
+	****************************************************************************************************************/
+
+	const int MAX_PATTERN_STEPS = 64;
+
+	// One bar of steps. The trigger lane is a bitset, the other lanes are one byte per step.
+	struct Pattern {
+		bitset<MAX_PATTERN_STEPS> steps;
+		unsigned char velocity[MAX_PATTERN_STEPS];
+		unsigned char note[MAX_PATTERN_STEPS];
+		unsigned char probability[MAX_PATTERN_STEPS];
+
+		Pattern() {
+			fill(velocity, velocity + MAX_PATTERN_STEPS, (unsigned char)127);
+			fill(note, note + MAX_PATTERN_STEPS, (unsigned char)64);
+			fill(probability, probability + MAX_PATTERN_STEPS, (unsigned char)100);
+		}
+
+		// 'X' / 'x' mark a hit, anything else is a rest
+		void SetFromString(const wstring& beat) {
+			steps.reset();
+			for (size_t i = 0; i < beat.size() && i < MAX_PATTERN_STEPS; i++)
+				steps[i] = beat[i] == L'X' || beat[i] == L'x';
+		}
+
+		wstring ToString(int length) const {
+			wstring beat(length, L'.');
+			for (int i = 0; i < length; i++)
+				if (steps[i]) beat[i] = L'X';
+			return beat;
+		}
+	};
+
+	struct SequencerEvent {
+		long long offset; // samples from the start of the pattern
+		int step;
+		int note;
+		I_FREQ_TYPE velocity;
+		int probability;
+	};
+
+	struct SequencerTrack {
+		BaseInstrument* instrument;
+		vector<Pattern> patterns;
+		vector<int> chain;      // song arrangement, indices into patterns played in order and looped
+		int length;             // steps per pattern on this track
+		I_FREQ_TYPE swing;      // 0.0 - 0.5 of a step, applied to every second step
+
+		// Compiled state, one sorted timeline per pattern
+		vector<vector<SequencerEvent>> timelines;
+		long long period;
+		long long position;
+		size_t cursor;
+		size_t chainIndex;
+
+		SequencerTrack() {
+			instrument = nullptr;
+			length = 16;
+			swing = 0.0;
+			period = 0;
+			position = 0;
+			cursor = 0;
+			chainIndex = 0;
+		}
+
+		int CurrentPattern() const {
+			return chain.empty() ? 0 : chain[chainIndex];
+		}
+	};
+
+	// Song-scale step sequencer. Every pattern is compiled into a sorted event timeline when it (or the
+	// tempo) changes, so rendering a block only walks the events that fall inside it. Edits must be made
+	// under the same lock the renderer holds.
+	class PatternSequencer {
+
+	public:
+		vector<SequencerTrack> tracks;
+
+		PatternSequencer(I_FREQ_TYPE tempo = 120.0, int subBeats = 4, unsigned int sampleRate = 44100) {
+			m_tempo = tempo;
+			m_subBeats = subBeats;
+			m_sampleRate = sampleRate;
+			m_random = 0x9E3779B9u;
+			m_currentStep = 0;
+		}
+
+		int AddTrack(BaseInstrument* instrument, int length = 16) {
+			SequencerTrack track;
+			track.instrument = instrument;
+			track.length = min(length, MAX_PATTERN_STEPS);
+			track.patterns.push_back(Pattern());
+			track.chain.push_back(0);
+			tracks.push_back(track);
+			Compile((int)tracks.size() - 1);
+			return (int)tracks.size() - 1;
+		}
+
+		int AddPattern(int track, const Pattern& pattern) {
+			tracks[track].patterns.push_back(pattern);
+			Compile(track);
+			return (int)tracks[track].patterns.size() - 1;
+		}
+
+		void SetPattern(int track, int index, const Pattern& pattern) {
+			tracks[track].patterns[index] = pattern;
+			Compile(track);
+		}
+
+		void SetChain(int track, const vector<int>& chain) {
+			tracks[track].chain = chain.empty() ? vector<int>(1, 0) : chain;
+			tracks[track].chainIndex = 0;
+			Compile(track);
+		}
+
+		void SetSwing(int track, I_FREQ_TYPE swing) {
+			tracks[track].swing = max(0.0, min(swing, 0.5));
+			Compile(track);
+		}
+
+		void SetLength(int track, int length) {
+			tracks[track].length = max(1, min(length, MAX_PATTERN_STEPS));
+			Compile(track);
+		}
+
+		void SetTempo(I_FREQ_TYPE tempo) {
+			m_tempo = tempo;
+			for (size_t t = 0; t < tracks.size(); t++)
+				Compile((int)t);
+		}
+
+		// Restarts the probability rolls
+		void Seed(unsigned int seed) {
+			m_random = seed != 0 ? seed : 0x9E3779B9u;
+		}
+
+		I_FREQ_TYPE GetTempo() const {
+			return m_tempo;
+		}
+
+		// Step under the playhead of the first track, for display
+		int CurrentStep() const {
+			return m_currentStep;
+		}
+
+		// Walks every track over the next 'frames' samples and calls emit(track, event, frameOffset) for each
+		// hit that passes its probability roll
+		template<class F>
+		void Render(unsigned int frames, F emit) {
+			for (size_t t = 0; t < tracks.size(); t++) {
+				SequencerTrack& track = tracks[t];
+				if (track.period <= 0)
+					continue;
+
+				unsigned int done = 0;
+				while (done < frames) {
+					const vector<SequencerEvent>& timeline = track.timelines[track.CurrentPattern()];
+					long long end = min(track.position + (long long)(frames - done), track.period);
+
+					for (; track.cursor < timeline.size() && timeline[track.cursor].offset < end; track.cursor++) {
+						const SequencerEvent& e = timeline[track.cursor];
+						if (e.probability >= 100 || (int)(NextRandom() % 100) < e.probability)
+							emit((int)t, e, done + (unsigned int)(e.offset - track.position));
+					}
+
+					done += (unsigned int)(end - track.position);
+					track.position = end;
+
+					if (track.position >= track.period) {
+						track.position = 0;
+						track.cursor = 0;
+						track.chainIndex = (track.chainIndex + 1) % track.chain.size();
+					}
+				}
+
+				if (t == 0)
+					m_currentStep = (int)(track.position / StepSamples());
+			}
+		}
+
+	private:
+		I_FREQ_TYPE StepSamples() const {
+			return (60.0 / m_tempo) / m_subBeats * m_sampleRate;
+		}
+
+		void Compile(int track) {
+			SequencerTrack& tr = tracks[track];
+			I_FREQ_TYPE stepSamples = StepSamples();
+
+			// Keep the playhead at the same musical position when the period changes
+			long long period = (long long)llround(stepSamples * tr.length);
+			if (tr.period > 0 && period != tr.period)
+				tr.position = (long long)((I_FREQ_TYPE)tr.position * period / tr.period) % max(period, 1LL);
+			tr.period = period;
+
+			// Reuses the timelines' storage, so a tempo change on the audio thread does not allocate
+			tr.timelines.resize(tr.patterns.size());
+			for (size_t p = 0; p < tr.patterns.size(); p++) {
+				const Pattern& pattern = tr.patterns[p];
+				vector<SequencerEvent>& timeline = tr.timelines[p];
+				timeline.clear();
+
+				for (int s = 0; s < tr.length; s++) {
+					if (!pattern.steps[s])
+						continue;
+
+					SequencerEvent e;
+					e.step = s;
+					e.offset = (long long)llround(stepSamples * (s + ((s & 1) ? tr.swing : 0.0)));
+					e.note = pattern.note[s];
+					e.velocity = pattern.velocity[s] / 127.0;
+					e.probability = pattern.probability[s];
+					timeline.push_back(e);
+				}
+
+				// Already sorted: steps go in order and swing delays a step by less than half a step
+			}
+
+			for (int& index : tr.chain)
+				index = max(0, min(index, (int)tr.patterns.size() - 1));
+			tr.chainIndex %= tr.chain.size();
+
+			// Resume after the events already played in this cycle
+			const vector<SequencerEvent>& timeline = tr.timelines[tr.CurrentPattern()];
+			tr.cursor = 0;
+			while (tr.cursor < timeline.size() && timeline[tr.cursor].offset < tr.position)
+				tr.cursor++;
+		}
+
+		unsigned int NextRandom() {
+			m_random ^= m_random << 13;
+			m_random ^= m_random >> 17;
+			m_random ^= m_random << 5;
+			return m_random;
+		}
+
+		I_FREQ_TYPE m_tempo;
+		int m_subBeats;
+		unsigned int m_sampleRate;
+		unsigned int m_random;
+		atomic<int> m_currentStep;
+	};
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+using namespace std;
+
+#include "SynthEngine.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	************************************************* SONGS ********************************************************
+	****************************************************************************************************************/
+
+	// Song file format, one statement per line, '#' starts a comment:
+	//
+	//   tempo 100
+	//   track Patches/KickDrum.patch [length <steps>] [swing <0.0 - 0.5>]
+	//   pattern X...X...X...X...
+	//   notes <note per step...>
+	//   velocity <0 - 127 per step...>
+	//   probability <0 - 100 per step...>
+	//   chain 0 0 1
+	//
+	// "pattern" adds a pattern to the last track (the first one replaces the track's empty default pattern),
+	// the lane statements apply to the last pattern and "chain" sets the last track's arrangement.
+
+	static bool ParseLane(istringstream& line, unsigned char* lane, int maximum) {
+		int value;
+		for (int s = 0; s < MAX_PATTERN_STEPS && line >> value; s++) {
+			if (value < 0 || value > maximum)
+				return false;
+			lane[s] = (unsigned char)value;
+		}
+		return !line.bad() && line.eof();
+	}
+
+	struct SongTrack {
+		string path;
+		int line;          // where the track statement is, for errors found once the file is read
+		int length;        // 0 keeps the sequencer's default
+		bool swung;
+		I_FREQ_TYPE swing;
+		vector<Pattern> patterns;
+		vector<int> chain;
+
+		SongTrack() {
+			line = 0;
+			length = 0;
+			swung = false;
+			swing = 0.0;
+		}
+	};
+
+	struct Song {
+		I_FREQ_TYPE tempo; // 0 keeps the engine's tempo
+		vector<SongTrack> tracks;
+
+		Song() {
+			tempo = 0.0;
+		}
+	};
+
+	// Parses a song from text without touching an engine. Returns false and leaves the line number in
+	// errorLine on a malformed statement.
+	bool ParseSong(istream& input, Song& song, int& errorLine) {
+		string text;
+		errorLine = 0;
+
+		while (getline(input, text)) {
+			errorLine++;
+
+			size_t comment = text.find('#');
+			if (comment != string::npos)
+				text.erase(comment);
+
+			istringstream line(text);
+			string keyword;
+			if (!(line >> keyword))
+				continue;
+
+			SongTrack* track = song.tracks.empty() ? nullptr : &song.tracks.back();
+			Pattern* pattern = track == nullptr || track->patterns.empty() ? nullptr : &track->patterns.back();
+
+			bool ok = true;
+			if (keyword == "tempo") {
+				I_FREQ_TYPE tempo;
+				ok = (bool)(line >> tempo) && tempo > 0.0;
+				if (ok) song.tempo = tempo;
+			}
+			else if (keyword == "track") {
+				SongTrack added;
+				added.line = errorLine;
+				ok = (bool)(line >> added.path);
+
+				string option;
+				while (ok && line >> option) {
+					I_FREQ_TYPE value;
+					ok = (bool)(line >> value);
+					if (ok && option == "length") added.length = (int)value;
+					else if (ok && option == "swing") {
+						added.swung = true;
+						added.swing = value;
+					}
+					else ok = false;
+				}
+				if (ok) song.tracks.push_back(added);
+			}
+			else if (keyword == "pattern") {
+				string beat;
+				ok = track != nullptr && (bool)(line >> beat);
+				if (ok) {
+					Pattern p;
+					p.SetFromString(wstring(beat.begin(), beat.end()));
+					track->patterns.push_back(p);
+				}
+			}
+			else if (keyword == "notes") ok = pattern != nullptr && ParseLane(line, pattern->note, 127);
+			else if (keyword == "velocity") ok = pattern != nullptr && ParseLane(line, pattern->velocity, 127);
+			else if (keyword == "probability") ok = pattern != nullptr && ParseLane(line, pattern->probability, 100);
+			else if (keyword == "chain") {
+				vector<int> chain;
+				int index;
+				while (line >> index)
+					chain.push_back(index);
+				ok = track != nullptr && !chain.empty();
+				if (ok) track->chain = chain;
+			}
+			else
+				ok = false;
+
+			if (!ok)
+				return false;
+		}
+
+		errorLine = 0;
+		return true;
+	}
+
+	// Hands a parsed song and its instruments, in track order, to the engine's sequencer. Call it while
+	// setting up or under the engine's Mutex().
+	void ApplySong(const Song& song, vector<SynthEngine::LoadedInstrument>& instruments, SynthEngine& engine) {
+		PatternSequencer& seq = engine.sequencer;
+		if (song.tempo > 0.0)
+			engine.SetTempo(song.tempo);
+
+		for (size_t t = 0; t < song.tracks.size(); t++) {
+			const SongTrack& songTrack = song.tracks[t];
+			int track = seq.AddTrack(engine.AdoptInstrument(instruments[t]));
+			if (songTrack.length > 0) seq.SetLength(track, songTrack.length);
+			if (songTrack.swung) seq.SetSwing(track, songTrack.swing);
+
+			// The first pattern replaces the track's empty default one
+			for (size_t p = 0; p < songTrack.patterns.size(); p++) {
+				if (p == 0)
+					seq.SetPattern(track, 0, songTrack.patterns[p]);
+				else
+					seq.AddPattern(track, songTrack.patterns[p]);
+			}
+			if (!songTrack.chain.empty())
+				seq.SetChain(track, songTrack.chain);
+		}
+	}
+
+	// Parses the song and reads its instruments from disk first; only handing them to the engine takes the
+	// voice lock, so a song loads while audio plays without the render thread waiting on the disk
+	bool LoadSong(const string& path, SynthEngine& engine) {
+		ifstream file(path);
+		if (!file.is_open())
+			return false;
+
+		Song song;
+		int errorLine = 0;
+		if (!ParseSong(file, song, errorLine)) {
+			cerr << path << ":" << errorLine << ": malformed song statement" << endl;
+			return false;
+		}
+
+		vector<SynthEngine::LoadedInstrument> instruments(song.tracks.size());
+		for (size_t t = 0; t < song.tracks.size(); t++)
+			if (!engine.ReadInstrument(song.tracks[t].path, instruments[t])) {
+				cerr << path << ":" << song.tracks[t].line << ": cannot load " << song.tracks[t].path << endl;
+				return false;
+			}
+
+		{
+			unique_lock<mutex> lm(engine.Mutex());
+			ApplySong(song, instruments, engine);
+		}
+
+		engine.CacheOneShots();
+		return true;
+	}
+}
@@ -0,0 +1,609 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+using namespace std;
+
+#include "Synthesizer.h"
+#include "Patch.h"
+#include "DspGraph.h"
+#include "Sequencer.h"
+#include "AudioArena.h"
+#include "AllocTrap.h"
+#include "RealtimeProfile.h"
+#include "Trace.h"
+#include "Parameters.h"
+#include "Modulation.h"
+#include "Noise.h"
+#include "OneShotCache.h"
+#include "SampleInstrument.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	********************************************** SYNTH ENGINE ****************************************************
+	****************************************************************************************************************/
+
+	// Everything one running synthesizer needs: instruments, voices, sequencer and the DSP graph. There is no
+	// global state, so any number of engines can render side by side in one process.
+	class SynthEngine {
+
+	public:
+		Bell bell;
+		Bell8 bell8;
+		Harmonica harmonica;
+		Supersaw supersaw;
+		KickDrum kickDrum;
+		SnareDrum snareDrum;
+		HiHat hiHat;
+
+		PatternSequencer sequencer;
+		BaseInstrument* keyboardInstrument;
+
+		// "master.volume", "tempo", "supersaw.detune|spread" and "<instrument>.volume|attack|decay|sustain|release"
+		// for every built-in and loaded instrument. Loaded instruments are named after their file, e.g. "KickDrum.volume".
+		// A note takes its envelope at note on, so attack, decay, sustain and release changes reach the next notes only,
+		// never the held ones.
+		ParameterBank parameters;
+
+		// Shared LFOs and envelopes of every instrument above and the routes from them to voices and parameters
+		ModulationEngine modulation;
+
+		// The engine's graph is one voices -> master chain with no level wide enough to share, so it renders on
+		// the calling thread unless graphWorkers asks for workers; < 0 picks a count from the core count
+		SynthEngine(unsigned int sampleRate = 44100, unsigned int maxFrames = 512, int graphWorkers = 0, size_t maxVoices = 256)
+			: sequencer(120.0, 4, sampleRate), modulation(sampleRate, maxVoices), m_noiseBank(sampleRate, maxVoices, maxFrames), m_arena(maxVoices * sizeof(Note) + 4096), m_runner(graphWorkers) {
+			m_sampleRate = sampleRate;
+			m_maxFrames = maxFrames;
+			m_time = 0.0;
+			m_oneShotCounter = 0;
+			m_droppedNotes = 0;
+			m_directSampleReads = false;
+			keyboardInstrument = &supersaw;
+
+			m_notes.Reserve(m_arena, maxVoices);
+			m_times.assign(maxFrames, 0.0);
+			m_voiceSamples.assign(maxFrames, 0.0);
+
+			// Voices -> master gain
+			shared_ptr<MixerNode> mixer = make_shared<MixerNode>(0.2);
+			int voices = m_graph.AddNode(make_shared<SourceNode>(RenderVoices, this));
+			int master = m_graph.AddNode(mixer);
+			m_graph.Connect(voices, master);
+			m_graph.SetOutput(master);
+			m_runner.Submit(m_graph.Compile(maxFrames));
+
+			parameters.MapController(7, parameters.Add("master.volume", &mixer->master, 0.0, 1.0, 0.05));
+			m_tempoParameter = parameters.Add("tempo", ApplyTempo, this, sequencer.GetTempo(), 20.0, 300.0, 0.0);
+			AddInstrumentParameters("bell", bell);
+			AddInstrumentParameters("bell8", bell8);
+			AddInstrumentParameters("harmonica", harmonica);
+			AddInstrumentParameters("supersaw", supersaw);
+			parameters.Add("supersaw.detune", &supersaw.unison.detune, 0.0, 100.0, 0.02, &supersaw.parametersChanged);
+			parameters.Add("supersaw.spread", &supersaw.unison.stereoSpread, 0.0, 1.0, 0.02, &supersaw.parametersChanged);
+			AddInstrumentParameters("kick", kickDrum);
+			AddInstrumentParameters("snare", snareDrum);
+			AddInstrumentParameters("hihat", hiHat);
+
+			modulation.BindLfo(&bell, bell.vibrato);
+			modulation.BindLfo(&bell8, bell8.vibrato);
+			modulation.BindLfo(&harmonica, harmonica.vibrato);
+			modulation.BindLfo(&supersaw, supersaw.vibrato);
+			modulation.BindLfo(&kickDrum, kickDrum.sweep);
+			modulation.BindLfo(&kickDrum, kickDrum.subSweep);
+			modulation.BindLfo(&snareDrum, snareDrum.sweep);
+			modulation.BindLfo(&hiHat, hiHat.sweep);
+		}
+
+		SynthEngine(const SynthEngine&) = delete;
+		SynthEngine& operator=(const SynthEngine&) = delete;
+
+		// An instrument read from its file but not yet known to the engine
+		struct LoadedInstrument {
+			string path;
+			unique_ptr<PatchInstrument> patch;
+			unique_ptr<SampleInstrument> sampler;
+		};
+
+		// Reads a patch, or a sample bank for .bank files, without touching the engine, so it can run on any
+		// thread while audio plays. Returns false when the file is missing or malformed.
+		bool ReadInstrument(const string& path, LoadedInstrument& loaded) const {
+			loaded.path = path;
+			if (path.size() > 5 && path.compare(path.size() - 5, 5, ".bank") == 0) {
+				loaded.sampler.reset(new SampleInstrument());
+				loaded.sampler->directRead = m_directSampleReads;
+				return LoadSampleBank(path, *loaded.sampler);
+			}
+
+			loaded.patch.reset(new PatchInstrument());
+			return LoadPatch(path, *loaded.patch);
+		}
+
+		// Takes ownership of an instrument ReadInstrument returned and registers its parameters and routes.
+		// Call it while setting up or under Mutex().
+		BaseInstrument* AdoptInstrument(LoadedInstrument& loaded) {
+			string prefix = FileStem(loaded.path);
+			if (loaded.sampler) {
+				m_samplers.push_back(move(loaded.sampler));
+				AddInstrumentParameters(prefix, *m_samplers.back());
+				return m_samplers.back().get();
+			}
+
+			if (!loaded.patch)
+				return nullptr;
+			m_patches.push_back(move(loaded.patch));
+			AddInstrumentParameters(prefix, *m_patches.back());
+			m_patches.back()->BindModulation(modulation, parameters, prefix);
+			return m_patches.back().get();
+		}
+
+		// Reads and adopts an instrument, owned by this engine. Returns nullptr when the file is missing or
+		// malformed. Call it while setting up.
+		BaseInstrument* LoadInstrument(const string& path) {
+			LoadedInstrument loaded;
+			if (!ReadInstrument(path, loaded))
+				return nullptr;
+			return AdoptInstrument(loaded);
+		}
+
+		// Prefers the patch file, falls back to the built-in instrument when it is missing or malformed
+		BaseInstrument* LoadInstrument(const string& path, BaseInstrument& fallback) {
+			bool loaded = true;
+			return LoadInstrument(path, fallback, loaded);
+		}
+
+		// As above, and clears 'loaded' when it falls back
+		BaseInstrument* LoadInstrument(const string& path, BaseInstrument& fallback, bool& loaded) {
+			BaseInstrument* instrument = LoadInstrument(path);
+			if (instrument != nullptr)
+				return instrument;
+			loaded = false;
+			return &fallback;
+		}
+
+		// Supersaw on the keyboard and the demo drum pattern. Returns false when a patch in Patches/ could not
+		// be loaded; the demo still plays, on the built-in instrument in its place.
+		bool SetupDemo() {
+			bool loaded = true;
+			keyboardInstrument = LoadInstrument("Patches/Supersaw.patch", supersaw, loaded);
+
+			SetTempo(100.0);
+			sequencer.AddTrack(LoadInstrument("Patches/KickDrum.patch", kickDrum, loaded));
+			sequencer.AddTrack(LoadInstrument("Patches/SnareDrum.patch", snareDrum, loaded));
+			sequencer.AddTrack(LoadInstrument("Patches/HiHat.patch", hiHat, loaded));
+
+			Pattern pattern;
+			pattern.SetFromString(L"X...X...X...X..."); // Kick
+			sequencer.SetPattern(0, 0, pattern);
+			pattern.SetFromString(L"...X..X....X..X."); // Snare
+			sequencer.SetPattern(1, 0, pattern);
+			pattern.SetFromString(L"..X...X...X...X."); // HiHat
+			sequencer.SetPattern(2, 0, pattern);
+
+			CacheOneShots();
+			return loaded;
+		}
+
+		// Pre-renders the given hits of one-shot instruments and re-renders cached hits whose instrument
+		// changed since. Rendering runs on the calling thread while the audio keeps playing; hits still
+		// sounding from a replaced entry finish on the live instrument. Hits of an instrument whose parameters
+		// are still moving, or that changes while it renders, are left for a later call.
+		void CacheOneShots(const vector<pair<BaseInstrument*, int>>& hits) {
+			vector<pair<BaseInstrument*, int>> wanted = hits;
+			for (auto& shot : m_oneShots)
+				wanted.push_back(make_pair(shot->instrument, shot->id));
+
+			// The instruments' fields are written by the audio thread, so pick the stale hits under its lock
+			vector<pair<BaseInstrument*, int>> stale;
+			{
+				unique_lock<mutex> lm(m_muxNotes);
+				for (auto& hit : wanted) {
+					// A pre-rendered hit would lose its routes
+					if (hit.first == nullptr || !IsOneShotInstrument(*hit.first) || modulation.HasRoutes(hit.first))
+						continue;
+					if (!parameters.Settled(&hit.first->parametersChanged))
+						continue;
+
+					const OneShot* cached = FindOneShot(hit.first, hit.second);
+					if (cached != nullptr && cached->parameters == hit.first->CachedParameterHash())
+						continue;
+					if (find(stale.begin(), stale.end(), hit) == stale.end())
+						stale.push_back(hit);
+				}
+			}
+
+			vector<unique_ptr<OneShot>> rendered;
+			for (auto& hit : stale) {
+				unique_ptr<OneShot> shot(new OneShot());
+				if (RenderOneShot(*hit.first, hit.second, m_sampleRate, *shot, m_muxNotes))
+					rendered.push_back(move(shot));
+			}
+
+			if (rendered.empty())
+				return;
+
+			// Replaced entries are freed after the lock is released, never on the audio thread
+			vector<unique_ptr<OneShot>> retired;
+			unique_lock<mutex> lm(m_muxNotes);
+
+			for (auto& shot : rendered) {
+				auto existing = find_if(m_oneShots.begin(), m_oneShots.end(), [&shot](const unique_ptr<OneShot>& item) {
+					return item->instrument == shot->instrument && item->id == shot->id;
+					}
+				);
+
+				if (existing == m_oneShots.end()) {
+					m_oneShots.push_back(move(shot));
+					continue;
+				}
+
+				for (auto& n : m_notes)
+					if (n.oneShot == existing->get())
+						n.oneShot = nullptr;
+				retired.push_back(move(*existing));
+				*existing = move(shot);
+			}
+
+			lm.unlock();
+		}
+
+		// Every hit the sequencer can play, plus a refresh of the cached ones
+		void CacheOneShots() {
+			vector<pair<BaseInstrument*, int>> hits;
+			{
+				unique_lock<mutex> lm(m_muxNotes);
+				for (const SequencerTrack& track : sequencer.tracks)
+					for (const Pattern& pattern : track.patterns)
+						for (int s = 0; s < track.length; s++)
+							if (pattern.steps[s])
+								hits.push_back(make_pair(track.instrument, (int)pattern.note[s]));
+			}
+			CacheOneShots(hits);
+		}
+
+		// Call from the editing thread now and then, e.g. once per UI frame. While a parameter ramps every hit
+		// of its instrument misses the cache and plays live; once that instrument's parameters settle this
+		// re-renders its hits that went stale. An instrument under a parameter route keeps playing live.
+		void RefreshOneShots() {
+			CacheOneShots();
+		}
+
+		// Retimes the sequencer right away and keeps the "tempo" parameter in step. Call it while setting up or
+		// under Mutex(); from other threads set the parameter instead.
+		void SetTempo(I_FREQ_TYPE tempo) {
+			sequencer.SetTempo(tempo);
+			parameters.Set(m_tempoParameter, tempo);
+		}
+
+		void NoteOn(BaseInstrument* instrument, int id, I_FREQ_TYPE time, I_FREQ_TYPE velocity = 1.0) {
+			unique_lock<mutex> lm(m_muxNotes);
+			Note note;
+			note.id = id;
+			note.on = time;
+			note.velocity = velocity;
+			note.active = true;
+			note.channel = instrument;
+			AddNote(note);
+		}
+
+		void NoteOff(BaseInstrument* instrument, int id, I_FREQ_TYPE time) {
+			unique_lock<mutex> lm(m_muxNotes);
+			for (auto& n : m_notes)
+				if (n.id == id && n.channel == instrument && n.off < n.on)
+					n.off = time;
+		}
+
+		// Keyboard handling: starts a held key, retriggers a released one and releases a key that went up
+		void KeyState(BaseInstrument* instrument, int id, bool down, I_FREQ_TYPE time) {
+			unique_lock<mutex> lm(m_muxNotes);
+			auto noteFound = find_if(m_notes.begin(), m_notes.end(), [id, instrument](Note const& item) {
+				return item.id == id && item.channel == instrument;
+				}
+			);
+
+			if (noteFound == m_notes.end()) {
+
+				if (down) {
+					Note note;
+					note.id = id;
+					note.on = time;
+					note.active = true;
+					note.channel = instrument;
+					AddNote(note);
+				}
+			}
+			else {
+
+				if (down) {
+
+					if (noteFound->off > noteFound->on) {
+
+						StopNote(*noteFound);
+						noteFound->on = time;
+						noteFound->active = true;
+						StartNote(*noteFound);
+					}
+				}
+				else {
+
+					if (noteFound->off < noteFound->on)
+						noteFound->off = time;
+				}
+			}
+		}
+
+		// Renders 'frames' interleaved frames starting at 'time'. frames must not exceed maxFrames.
+		void Render(I_FREQ_TYPE* output, unsigned int frames, unsigned int channels, I_FREQ_TYPE time, I_FREQ_TYPE timeStep) {
+			AllocTrapScope trap;
+			TraceScope trace("engine render");
+
+			DspContext ctx;
+			ctx.time = time;
+			ctx.timeStep = timeStep;
+			ctx.frames = frames;
+			m_runner.Process(ctx, output);
+
+			// The graph is mono, spread it over the interleaved channels in place
+			for (unsigned int n = frames; n-- > 0;)
+				for (unsigned int c = 0; c < channels; c++)
+					output[n * channels + c] = output[n];
+		}
+
+		// Renders mono on the engine's own clock, any number of frames
+		void RenderOffline(I_FREQ_TYPE* output, unsigned int frames) {
+			I_FREQ_TYPE timeStep = 1.0 / m_sampleRate;
+
+			while (frames > 0) {
+				unsigned int chunk = min(frames, m_maxFrames);
+				Render(output, chunk, 1, m_time, timeStep);
+				m_time += chunk * timeStep;
+				output += chunk;
+				frames -= chunk;
+			}
+		}
+
+		// BlockFunction for NoiseGenerator, userData is the engine
+		static void RenderCallback(void* userData, I_FREQ_TYPE* output, unsigned int frames, unsigned int channels, I_FREQ_TYPE time, I_FREQ_TYPE timeStep) {
+			((SynthEngine*)userData)->Render(output, frames, channels, time, timeStep);
+		}
+
+		// Offline renders only: sample instruments, loaded now or later, read their files on the rendering thread
+		// instead of streaming them, so a render faster than real time never outruns the disk reader. Call
+		// before any note plays.
+		void SetDirectSampleReads(bool direct) {
+			m_directSampleReads = direct;
+			for (auto& sampler : m_samplers)
+				sampler->directRead = direct;
+		}
+
+		// Restarts the engine's noise streams and the sequencer's probability rolls. Two engines given the same
+		// seed, setup and events render the same samples offline.
+		void SetSeed(unsigned int seed) {
+			unique_lock<mutex> lm(m_muxNotes);
+			m_noise.Seed(seed);
+			m_noiseBank.Seed(seed);
+			sequencer.Seed(seed);
+		}
+
+		// Pre-faults and locks the voice arena and the one-shot buffers. Returns false if any range could not be locked.
+		bool LockMemory() {
+			unique_lock<mutex> lm(m_muxNotes);
+			bool locked = LockAudioMemory(m_arena.Data(), m_arena.Capacity());
+			const vector<I_FREQ_TYPE>& lines = modulation.State().lines;
+			locked = LockAudioMemory((void*)lines.data(), lines.size() * sizeof(I_FREQ_TYPE)) && locked;
+			const vector<I_FREQ_TYPE>& noise = m_noiseBank.Blocks().samples;
+			locked = LockAudioMemory((void*)noise.data(), noise.size() * sizeof(I_FREQ_TYPE)) && locked;
+			for (auto& shot : m_oneShots)
+				for (auto& variant : shot->variants)
+					locked = LockAudioMemory(variant.data(), variant.size() * sizeof(I_FREQ_TYPE)) && locked;
+			return locked;
+		}
+
+		// Hands the render thread's profile to the graph workers. Returns false if a worker did not apply it
+		// within the timeout.
+		bool SetWorkerProfile(const RealtimeProfile& profile, int timeoutMs = 500) {
+			m_runner.SetRealtimeProfile(profile);
+			for (int wait = 0; wait < timeoutMs && m_runner.WorkersProfiled() < m_runner.WorkerCount(); wait += 10)
+				this_thread::sleep_for(chrono::milliseconds(10));
+			return m_runner.WorkersProfiled() == m_runner.WorkerCount();
+		}
+
+		// Notes dropped because every voice was playing
+		unsigned long long DroppedNotes() const { return m_droppedNotes; }
+
+		// Noise streams no voice holds. Read it under Mutex() or while no audio runs.
+		size_t FreeNoiseStreams() const { return m_noiseBank.FreeStreams(); }
+
+		I_FREQ_TYPE Time() const { return m_time; }
+		unsigned int SampleRate() const { return m_sampleRate; }
+		unsigned int MaxFrames() const { return m_maxFrames; }
+
+		// Held by the render thread for the whole block; take it before editing the sequencer
+		mutex& Mutex() { return m_muxNotes; }
+
+	private:
+		typedef bool(*lambda)(Note const& item);
+		template<class T>
+		static void SafeRemove(T& v, lambda f) {
+
+			// Compacts in place, keeping the order of the survivors
+			v.erase(remove_if(v.begin(), v.end(), [f](Note const& item) { return !f(item); }), v.end());
+		}
+
+		// Parameters are registered before audio runs, so this is only called while setting up
+		void AddInstrumentParameters(const string& prefix, BaseInstrument& instrument) {
+			bool* changed = &instrument.parametersChanged;
+			parameters.Add(prefix + ".volume", &instrument.volume, 0.0, 4.0, 0.02, changed);
+			parameters.Add(prefix + ".attack", &instrument.envelopeOutput.attackTime, 0.0, 5.0, 0.02, changed);
+			parameters.Add(prefix + ".decay", &instrument.envelopeOutput.decayTime, 0.0, 5.0, 0.02, changed);
+			parameters.Add(prefix + ".sustain", &instrument.envelopeOutput.sustainTime, 0.0, 1.0, 0.02, changed);
+			parameters.Add(prefix + ".release", &instrument.envelopeOutput.releaseTime, 0.0, 10.0, 0.02, changed);
+		}
+
+		static string FileStem(const string& path) {
+			size_t slash = path.find_last_of("/\\");
+			string file = slash == string::npos ? path : path.substr(slash + 1);
+			return file.substr(0, file.find('.'));
+		}
+
+		static void ApplyTempo(void* userData, I_FREQ_TYPE tempo) {
+			SynthEngine* engine = (SynthEngine*)userData;
+			if (tempo != engine->sequencer.GetTempo())
+				engine->sequencer.SetTempo(tempo);
+		}
+
+		const OneShot* FindOneShot(const BaseInstrument* instrument, int id) const {
+			for (auto& shot : m_oneShots)
+				if (shot->instrument == instrument && shot->id == id)
+					return shot.get();
+			return nullptr;
+		}
+
+		// Points a new note at its pre-rendered hit when there is one that still matches the instrument,
+		// otherwise lets the instrument and the modulation engine set up its voice
+		void StartNote(Note& n) {
+			if (n.channel == nullptr)
+				return;
+
+			const OneShot* shot = FindOneShot(n.channel, n.id);
+			if (shot != nullptr && shot->parameters == n.channel->CachedParameterHash()) {
+				n.oneShot = shot;
+				n.oneShotVariant = m_oneShotCounter++;
+			}
+			else {
+				n.channel->Prepare(n);
+				n.channel->NoteStarted(n);
+				modulation.Start(n);
+				m_noiseBank.Start(n);
+			}
+		}
+
+		// Starts a note and adds it to the voices. A full voice list drops the note before it claims a sampler
+		// stream, a modulation slot or a noise stream, which nothing would ever give back.
+		bool AddNote(Note& n) {
+			if (m_notes.size() == m_notes.capacity()) {
+				m_droppedNotes++;
+				return false;
+			}
+			StartNote(n);
+			return m_notes.push_back(n);
+		}
+
+		void StopNote(Note& n) {
+			if (n.channel != nullptr)
+				n.channel->NoteStopped(n);
+			modulation.Stop(n);
+			m_noiseBank.Stop(n);
+		}
+
+		// Starts the sequencer hits that fall in this block at their exact sample, then mixes every active
+		// note into the block. The master level is applied by the graph.
+		static void RenderVoices(void* userData, const DspContext& ctx, I_FREQ_TYPE* output) {
+			SynthEngine* engine = (SynthEngine*)userData;
+			unique_lock<mutex> lm(engine->m_muxNotes, defer_lock);
+			{
+				TraceScope trace("voice lock");
+				lm.lock();
+			}
+			NoiseScope noise(engine->m_noise);
+			ModulationScope modulation(engine->modulation.State());
+
+			// Parameters first, under the lock, so everything below sees this block's values
+			engine->modulation.ApplyParameterRoutes(engine->parameters, ctx.time);
+			engine->parameters.Process(ctx.frames, engine->m_sampleRate);
+
+			{
+				TraceScope trace("sequencer");
+				engine->sequencer.Render(ctx.frames, [&ctx, engine](int track, const SequencerEvent& e, unsigned int frameOffset) {
+					Note n;
+					n.channel = engine->sequencer.tracks[track].instrument;
+					n.active = true;
+					n.id = e.note;
+					n.velocity = e.velocity;
+					n.on = ctx.time + frameOffset * ctx.timeStep;
+					engine->AddNote(n);
+				});
+			}
+
+			// Every voice's noise for the block in one pass, including the voices the sequencer just started
+			engine->m_noiseBank.Render(ctx.time, ctx.timeStep, ctx.frames);
+			NoiseBlocksScope noiseBlocks(engine->m_noiseBank.Blocks());
+
+			// Pre-rendered hits are added a whole block at a time
+			{
+				TraceScope trace("one-shots");
+				fill(output, output + ctx.frames, 0.0);
+				for (auto& n : engine->m_notes)
+					if (n.oneShot != nullptr && !MixOneShot(n, ctx.time, ctx.timeStep, ctx.frames, output)) {
+						engine->StopNote(n);
+						n.active = false;
+					}
+			}
+
+			// Live voices, one run between control ticks at a time: every note renders the whole run, then the
+			// finished ones are removed
+			TraceScope trace("voices");
+			I_FREQ_TYPE* times = engine->m_times.data();
+			I_FREQ_TYPE* samples = engine->m_voiceSamples.data();
+			for (unsigned int i = 0; i < ctx.frames; i++)
+				times[i] = ctx.time + i * ctx.timeStep;
+
+			for (unsigned int first = 0; first < ctx.frames;) {
+				unsigned int end = first + engine->modulation.Process(engine->m_notes, times[first], ctx.timeStep, ctx.frames - first);
+
+				for (auto& n : engine->m_notes) {
+					if (n.oneShot != nullptr || n.channel == nullptr)
+						continue;
+
+					// A note is silent on its first sample; skipping it keeps envelopes from reading zero and finishing early
+					unsigned int start = first;
+					while (start < end && times[start] <= n.on)
+						start++;
+					if (start == end)
+						continue;
+
+					bool noteFinished = false;
+					unsigned int played = n.channel->RenderBlock(n, times + start, end - start, samples, noteFinished);
+					for (unsigned int i = 0; i < played; i++)
+						output[start + i] += samples[i] * n.velocity * engine->modulation.Amplitude(n, times[start + i]);
+
+					if (noteFinished) {
+						engine->StopNote(n);
+						n.active = false;
+					}
+				}
+
+				SafeRemove<FixedList<Note>>(engine->m_notes, [](Note const& item) { return item.active; });
+				first = end;
+			}
+		}
+
+		unsigned int m_sampleRate;
+		unsigned int m_maxFrames;
+		I_FREQ_TYPE m_time;
+		NoiseState m_noise;
+		NoiseBank m_noiseBank;
+
+		AudioArena m_arena;
+		FixedList<Note> m_notes;
+		vector<I_FREQ_TYPE> m_times;        // sample times of the block being rendered
+		vector<I_FREQ_TYPE> m_voiceSamples; // one voice's run
+		mutex m_muxNotes;
+		vector<unique_ptr<PatchInstrument>> m_patches;
+		vector<unique_ptr<SampleInstrument>> m_samplers;
+		bool m_directSampleReads;
+		vector<unique_ptr<OneShot>> m_oneShots;
+		unsigned int m_oneShotCounter;
+		atomic<unsigned long long> m_droppedNotes;
+		int m_tempoParameter;
+
+		DspGraph m_graph;
+		DspGraphRunner m_runner;
+	};
+}
@@ -0,0 +1,897 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <string>
+#include <atomic>
+using namespace std;
+
+#include "OscilatorThread.h"
+#include "Unison.h"
+
+namespace synthesizer {
+
+	// Converts frequency (Hz) to angular velocity
+	I_FREQ_TYPE ConvertToHz(const I_FREQ_TYPE hertz) {
+		return hertz * 2.0 * PI;
+	}
+
+	struct Envelope {
+		virtual I_FREQ_TYPE amplitude(const I_FREQ_TYPE time, const I_FREQ_TYPE timeOn, const I_FREQ_TYPE timeOff) = 0;
+	};
+
+	struct EnvelopeADSR : public Envelope {
+		I_FREQ_TYPE attackTime;
+		I_FREQ_TYPE decayTime;
+		I_FREQ_TYPE sustainTime;
+		I_FREQ_TYPE releaseTime;
+		I_FREQ_TYPE startAmplitude;
+
+		EnvelopeADSR() {
+			attackTime = 0.1;
+			decayTime = 0.1;
+			sustainTime = 1.0;
+			releaseTime = 0.2;
+			startAmplitude = 1.0;
+		}
+
+		virtual I_FREQ_TYPE amplitude(const I_FREQ_TYPE time, const I_FREQ_TYPE timeOn, const I_FREQ_TYPE timeOff) {
+			I_FREQ_TYPE amplitude = 0.0;
+			I_FREQ_TYPE releaseAmplitude = 0.0;
+
+			if (timeOn > timeOff) { // Note is on
+
+				I_FREQ_TYPE lifeTime = time - timeOn;
+
+				if (lifeTime <= attackTime)
+					amplitude = (lifeTime / attackTime) * startAmplitude;
+
+				if (lifeTime > attackTime && lifeTime <= (attackTime + decayTime))
+					amplitude = ((lifeTime - attackTime) / decayTime) * (sustainTime - startAmplitude) + startAmplitude;
+
+				if (lifeTime > (attackTime + decayTime))
+					amplitude = sustainTime;
+			}
+			else { // Note is off
+
+				I_FREQ_TYPE lifeTime = timeOff - timeOn;
+
+				if (lifeTime <= attackTime)
+					releaseAmplitude = (lifeTime / attackTime) * startAmplitude;
+
+				if (lifeTime > attackTime && lifeTime <= (attackTime + decayTime))
+					releaseAmplitude = ((lifeTime - attackTime) / decayTime) * (sustainTime - startAmplitude) + startAmplitude;
+
+				if (lifeTime > (attackTime + decayTime))
+					releaseAmplitude = sustainTime;
+
+				// A zero release cuts the note, dividing by it would turn the rest of the note into NaN
+				if (releaseTime > 0.0)
+					amplitude = ((time - timeOff) / releaseTime) * (0.0 - releaseAmplitude) + releaseAmplitude;
+			}
+
+			// Amplitude should not be negative
+			if (amplitude <= 0.01)
+				amplitude = 0.0;
+
+			return amplitude;
+		}
+	};
+
+	// An ADSR envelope as it was when the note started, its segments resolved to where they end and how steep they
+	// are. amplitude() gives what EnvelopeADSR::amplitude would, without the divisions and the virtual call.
+	struct VoiceEnvelope {
+		I_FREQ_TYPE attackEnd;   // lifetime the attack ends at, the attack time
+		I_FREQ_TYPE decayEnd;    // lifetime the decay ends at
+		I_FREQ_TYPE attackSlope; // amplitude per second
+		I_FREQ_TYPE decaySlope;
+		I_FREQ_TYPE start;       // amplitude at the end of the attack
+		I_FREQ_TYPE sustain;
+		I_FREQ_TYPE releaseRate; // 1 / release time, 0 cuts the note at the note off
+
+		VoiceEnvelope() {
+			Set(EnvelopeADSR());
+		}
+
+		void Set(const EnvelopeADSR& shape) {
+			attackEnd = shape.attackTime;
+			decayEnd = shape.attackTime + shape.decayTime;
+			attackSlope = shape.attackTime > 0.0 ? shape.startAmplitude / shape.attackTime : 0.0;
+			decaySlope = shape.decayTime > 0.0 ? (shape.sustainTime - shape.startAmplitude) / shape.decayTime : 0.0;
+			start = shape.startAmplitude;
+			sustain = shape.sustainTime;
+			releaseRate = shape.releaseTime > 0.0 ? 1.0 / shape.releaseTime : 0.0;
+		}
+
+		// Level of a held note 'lifeTime' seconds after its note on
+		I_FREQ_TYPE Held(const I_FREQ_TYPE lifeTime) const {
+			if (lifeTime <= attackEnd)
+				return lifeTime * attackSlope;
+			if (lifeTime <= decayEnd)
+				return (lifeTime - attackEnd) * decaySlope + start;
+			return sustain;
+		}
+
+		I_FREQ_TYPE amplitude(const I_FREQ_TYPE time, const I_FREQ_TYPE timeOn, const I_FREQ_TYPE timeOff) const {
+			I_FREQ_TYPE amplitude = 0.0;
+			if (timeOn > timeOff)
+				amplitude = Held(time - timeOn);
+			else if (releaseRate > 0.0) {
+				I_FREQ_TYPE releaseAmplitude = Held(timeOff - timeOn);
+				amplitude = releaseAmplitude - (time - timeOff) * releaseRate * releaseAmplitude;
+			}
+
+			if (amplitude <= 0.01)
+				amplitude = 0.0;
+			return amplitude;
+		}
+	};
+
+	const int VOICE_LAYERS = 6; // layers a voice record keeps, the rest are worked out while rendering
+
+	// What a voice needs that stays fixed while it plays, resolved once at note on by the instrument's Prepare so
+	// the render loop reads it instead of calling pow and going through the instrument's envelope
+	struct VoiceRecord {
+		int layers;
+		I_FREQ_TYPE hertz[VOICE_LAYERS];
+		I_FREQ_TYPE angular[VOICE_LAYERS]; // ConvertToHz(hertz), the phase step per second
+		I_FREQ_TYPE gain[VOICE_LAYERS];
+		VoiceEnvelope envelope;            // the instrument's envelope as it was when the note started
+
+		VoiceRecord() {
+			layers = 0;
+		}
+
+		void Reset(const EnvelopeADSR& shape) {
+			layers = 0;
+			envelope.Set(shape);
+		}
+
+		void AddLayer(const I_FREQ_TYPE layerHertz, const I_FREQ_TYPE layerGain) {
+			if (layers >= VOICE_LAYERS)
+				return;
+			hertz[layers] = layerHertz;
+			angular[layers] = layerHertz * 2.0 * PI;
+			gain[layers] = layerGain;
+			layers++;
+		}
+	};
+
+	struct BaseInstrument;
+	struct OneShot;
+
+	const int VOICE_REFUSED = -2; // Note::voice of a note that found every slot of its instrument taken; it plays silence
+
+	struct Note {
+		int id;
+		I_FREQ_TYPE on;
+		I_FREQ_TYPE off;
+		I_FREQ_TYPE velocity;
+		bool active;
+		BaseInstrument* channel;
+		const OneShot* oneShot; // pre-rendered hit played instead of the instrument, nullptr renders live
+		int oneShotVariant;
+		int voice;              // per-voice state slot owned by the instrument, -1 when it has none, see VOICE_REFUSED
+		int modulation;         // voice slot in the engine's modulation state, -1 evaluates modulation exactly
+		int noise;              // voice slot in the engine's noise blocks, -1 reads the render's shared stream
+		VoiceRecord record;     // filled by the instrument at note on
+
+		Note() {
+			id = 0;
+			on = 0.0;
+			off = -1.0; // before any on time, so a note started at time 0 is held rather than released
+			velocity = 1.0;
+			active = false;
+			channel = nullptr;
+			oneShot = nullptr;
+			oneShotVariant = 0;
+			voice = -1;
+			modulation = -1;
+			noise = -1;
+		}
+
+	};
+
+	const int SINE_WAVE = 0;
+	const int SQUARE_WAVE = 1;
+	const int TRIANGLE_WAVE = 2;
+	const int SAW_WAVE = 3;
+	const int NOISE = 4;
+
+	// xorshift32 noise stream. A render installs its own stream with NoiseScope, so noise is reproducible for a
+	// given seed and independent renders on different threads never share state. Live voices of instruments
+	// that play noise read streams of their own instead, see VoiceNoise.
+	struct NoiseState {
+		unsigned int state;
+
+		NoiseState(unsigned int seed = 0x2545F491u) {
+			Seed(seed);
+		}
+
+		void Seed(unsigned int seed) {
+			state = seed != 0 ? seed : 0x2545F491u;
+		}
+
+		I_FREQ_TYPE Next() {
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return 2.0 * ((I_FREQ_TYPE)state / 4294967295.0) - 1.0;
+		}
+	};
+
+	static thread_local NoiseState threadNoise;
+	static thread_local NoiseState* activeNoise = nullptr;
+
+	struct NoiseScope {
+		NoiseState* previous;
+
+		NoiseScope(NoiseState& noise) {
+			previous = activeNoise;
+			activeNoise = &noise;
+		}
+
+		~NoiseScope() {
+			activeNoise = previous;
+		}
+	};
+
+	// White noise in [-1, 1] from the active stream, or the thread's own stream outside of a NoiseScope
+	I_FREQ_TYPE WhiteNoise() {
+		return (activeNoise != nullptr ? activeNoise : &threadNoise)->Next();
+	}
+
+	const int NOISE_COLOR_NONE = 0;  // the instrument plays no noise, its voices get no stream
+	const int NOISE_COLOR_WHITE = 1;
+	const int NOISE_COLOR_PINK = 2;  // -3 dB per octave
+	const int NOISE_COLOR_BAND = 3;  // white through a band pass at 'hertz', 0 dB at the centre
+
+	// The noise an instrument's voices play, see NoiseBank in Noise.h
+	struct NoiseShape {
+		int color;
+		I_FREQ_TYPE hertz;
+		I_FREQ_TYPE q;
+
+		NoiseShape() {
+			color = NOISE_COLOR_NONE;
+			hertz = 1000.0;
+			q = 1.0;
+		}
+	};
+
+	// Every voice's own noise for the block being rendered, filled by the engine before the voices run
+	struct NoiseBlocks {
+		vector<I_FREQ_TYPE> samples; // voice * stride + sample
+		unsigned int stride;
+		unsigned int frames;
+		I_FREQ_TYPE blockStart;
+		I_FREQ_TYPE timeStep;
+
+		NoiseBlocks() {
+			stride = 0;
+			frames = 0;
+			blockStart = 0.0;
+			timeStep = 1.0;
+		}
+
+		I_FREQ_TYPE Value(int voice, I_FREQ_TYPE time) const {
+			long index = lround((time - blockStart) / timeStep);
+			index = max(0L, min(index, (long)frames - 1));
+			return samples[voice * stride + index];
+		}
+	};
+
+	static thread_local const NoiseBlocks* activeNoiseBlocks = nullptr;
+
+	struct NoiseBlocksScope {
+		const NoiseBlocks* previous;
+
+		NoiseBlocksScope(const NoiseBlocks& blocks) {
+			previous = activeNoiseBlocks;
+			activeNoiseBlocks = &blocks;
+		}
+
+		~NoiseBlocksScope() {
+			activeNoiseBlocks = previous;
+		}
+	};
+
+	// The note's own noise stream, or white noise from the active stream for a note without one (voices
+	// beyond the slot count)
+	I_FREQ_TYPE VoiceNoise(const Note& n, const I_FREQ_TYPE time) {
+		if (activeNoiseBlocks != nullptr && n.noise >= 0 && activeNoiseBlocks->frames > 0)
+			return activeNoiseBlocks->Value(n.noise, time);
+		return WhiteNoise();
+	}
+
+	// The waveform at 'frequency' radians
+	I_FREQ_TYPE OscillatePhase(const I_FREQ_TYPE frequency, const int type = SINE_WAVE, I_FREQ_TYPE custom = 50.0) {
+		switch (type) {
+		case SINE_WAVE:
+			return sin(frequency);
+
+		case SQUARE_WAVE:
+			return sin(frequency) > 0 ? 1.0 : -1.0;
+
+		case TRIANGLE_WAVE:
+			return asin(sin(frequency)) * (2.0 / PI);
+
+		case SAW_WAVE: {
+			I_FREQ_TYPE output = 0.0;
+			for (I_FREQ_TYPE n = 1.0; n < custom; n++)
+				output += (sin(n * frequency)) / n;
+			return output * (2.0 / PI);
+		}
+
+		case NOISE:
+			return WhiteNoise();
+
+		default:
+			return 0.0;
+		}
+	}
+
+	// 'modulation' is the vibrato term: the phase is pushed by modulation * hertz, so an LFO of amplitude a
+	// passed as a * lfo matches the lfo arguments of Oscillate
+	I_FREQ_TYPE OscillateModulated(const I_FREQ_TYPE time, const I_FREQ_TYPE hertz, const int type = SINE_WAVE,
+		const I_FREQ_TYPE modulation = 0.0, I_FREQ_TYPE custom = 50.0) {
+
+		return OscillatePhase(ConvertToHz(hertz) * time + modulation * hertz, type, custom);
+	}
+
+	// A layer of a prepared voice, 'lifeTime' seconds into the note, the same as OscillateModulated at its pitch
+	I_FREQ_TYPE OscillateLayer(const VoiceRecord& voice, const int layer, const I_FREQ_TYPE lifeTime, const int type = SINE_WAVE,
+		const I_FREQ_TYPE modulation = 0.0, I_FREQ_TYPE custom = 50.0) {
+
+		return OscillatePhase(voice.angular[layer] * lifeTime + modulation * voice.hertz[layer], type, custom);
+	}
+
+	I_FREQ_TYPE Oscillate(const I_FREQ_TYPE time, const I_FREQ_TYPE hertz, const int type = SINE_WAVE,
+		const I_FREQ_TYPE lfoHertz = 0.0, const I_FREQ_TYPE lfoAmplitude = 0.0, I_FREQ_TYPE custom = 50.0) {
+
+		return OscillateModulated(time, hertz, type, lfoAmplitude * sin(ConvertToHz(lfoHertz) * time), custom);
+	}
+
+	/***************************************************************************************************************
+	********************************************** MODULATION ******************************************************
+	****************************************************************************************************************/
+
+	// Modulation targets every voice has, see Modulation.h for the sources and the routing
+	const int MOD_PITCH = 0;     // phase term, in the units of OscillateModulated's modulation; routes are in semitones
+	const int MOD_AMPLITUDE = 1; // the voice is scaled by 1 + value
+	const int MOD_TARGETS = 2;
+	const int MOD_SOURCES = 16;  // LFOs and envelopes per engine
+	const int MOD_STRIDE = MOD_TARGETS + MOD_SOURCES;
+
+	// Low frequency oscillator. Key synced LFOs start at phase 0 on the note on, free ones run on the clock.
+	// 'source' is the shared slot the engine evaluates it in, -1 until it is bound.
+	struct ModLfo {
+		I_FREQ_TYPE hertz;
+		int shape;
+		bool keySync;
+		int source;
+
+		ModLfo(I_FREQ_TYPE lfoHertz = 0.0, int lfoShape = SINE_WAVE, bool lfoKeySync = true) {
+			hertz = lfoHertz;
+			shape = lfoShape;
+			keySync = lfoKeySync;
+			source = -1;
+		}
+	};
+
+	// -1 to 1 at 'cycles' periods into the LFO. Every shape starts at 0 and rises, like the sine.
+	I_FREQ_TYPE LfoShapeValue(const int shape, const I_FREQ_TYPE cycles) {
+		if (shape == SINE_WAVE)
+			return sin(2.0 * PI * cycles);
+
+		I_FREQ_TYPE phase = cycles - floor(cycles);
+		switch (shape) {
+		case SQUARE_WAVE:
+			return phase < 0.5 ? 1.0 : -1.0;
+
+		case TRIANGLE_WAVE:
+			return phase < 0.25 ? 4.0 * phase : phase < 0.75 ? 2.0 - 4.0 * phase : 4.0 * phase - 4.0;
+
+		case SAW_WAVE:
+			return phase < 0.5 ? 2.0 * phase : 2.0 * phase - 2.0;
+
+		default:
+			return 0.0;
+		}
+	}
+
+	// Control rate values of every voice, written by the engine at each control tick. Per voice and slot it
+	// holds a line through the values at this tick and the next, so a read is one multiply-add.
+	struct ModulationState {
+		vector<I_FREQ_TYPE> lines; // voice * MOD_STRIDE + slot: value at tickStart, then slope per second
+		I_FREQ_TYPE tickStart;
+
+		ModulationState() {
+			tickStart = 0.0;
+		}
+
+		I_FREQ_TYPE Value(int voice, int slot, I_FREQ_TYPE time) const {
+			const I_FREQ_TYPE* line = &lines[(voice * MOD_STRIDE + slot) * 2];
+			return line[0] + line[1] * (time - tickStart);
+		}
+	};
+
+	static thread_local const ModulationState* activeModulation = nullptr;
+
+	struct ModulationScope {
+		const ModulationState* previous;
+
+		ModulationScope(const ModulationState& modulation) {
+			previous = activeModulation;
+			activeModulation = &modulation;
+		}
+
+		~ModulationScope() {
+			activeModulation = previous;
+		}
+	};
+
+	// The LFO for this note: the engine's interpolated value when the note has a modulation slot, evaluated
+	// exactly otherwise (one-shot renders, voices beyond the slot count)
+	I_FREQ_TYPE LfoValue(const ModLfo& lfo, const Note& n, const I_FREQ_TYPE time) {
+		if (activeModulation != nullptr && n.modulation >= 0 && lfo.source >= 0)
+			return activeModulation->Value(n.modulation, MOD_TARGETS + lfo.source, time);
+		return LfoShapeValue(lfo.shape, lfo.hertz * (lfo.keySync ? time - n.on : time));
+	}
+
+	// Sum of the routes to a voice target, 0 without routes
+	I_FREQ_TYPE ModulationTarget(const Note& n, const int target, const I_FREQ_TYPE time) {
+		if (activeModulation != nullptr && n.modulation >= 0)
+			return activeModulation->Value(n.modulation, target, time);
+		return 0.0;
+	}
+
+	const int DEFAULT_SCALE = 0;
+
+	/***************************************************************************************************************
+	************************************************ TUNING ********************************************************
+	****************************************************************************************************************/
+
+	const int PITCH_TABLE_SIZE = 128;
+
+	// Frequencies of notes 0 - 127, worked out by the compiler from the 12 steps of one octave
+	struct PitchTable {
+		I_FREQ_TYPE hertz[PITCH_TABLE_SIZE];
+		I_FREQ_TYPE steps[12]; // frequencies of notes 0 - 11
+
+		// 'octave' holds the ratios of the 12 notes of an octave to its first note, 'base' is the frequency of note 0
+		constexpr PitchTable(const I_FREQ_TYPE(&octave)[12], const I_FREQ_TYPE base) : hertz{}, steps{} {
+			for (int step = 0; step < 12; step++)
+				steps[step] = base * octave[step];
+
+			I_FREQ_TYPE octaveBase = 1.0;
+			for (int note = 0; note < PITCH_TABLE_SIZE; note++) {
+				if (note > 0 && note % 12 == 0)
+					octaveBase *= 2.0;
+				hertz[note] = octaveBase * steps[note % 12];
+			}
+		}
+	};
+
+	constexpr I_FREQ_TYPE EQUAL_STEPS[12] = { 1.0, 1.0594630943592953, 1.122462048309373, 1.189207115002721,
+		1.2599210498948732, 1.3348398541700344, 1.4142135623730951, 1.4983070768766815, 1.5874010519681994,
+		1.681792830507429, 1.7817974362806785, 1.8877486253633868 };
+
+	// 5-limit just intonation on note 0 and its octaves
+	constexpr I_FREQ_TYPE JUST_STEPS[12] = { 1.0, 16.0 / 15.0, 9.0 / 8.0, 6.0 / 5.0, 5.0 / 4.0, 4.0 / 3.0, 45.0 / 32.0,
+		3.0 / 2.0, 8.0 / 5.0, 5.0 / 3.0, 9.0 / 5.0, 15.0 / 8.0 };
+
+	constexpr PitchTable EQUAL_TEMPERAMENT(EQUAL_STEPS, 8.0);
+	constexpr PitchTable JUST_INTONATION(JUST_STEPS, 8.0);
+
+	// Notes outside the table are folded into it by octaves
+	I_FREQ_TYPE Scale(const int noteId, const PitchTable& tuning = EQUAL_TEMPERAMENT) {
+		if (noteId >= 0 && noteId < PITCH_TABLE_SIZE)
+			return tuning.hertz[noteId];
+
+		int step = ((noteId % 12) + 12) % 12;
+		return ldexp(tuning.steps[step], (noteId - step) / 12);
+	}
+
+	/***************************************************************************************************************
+	*********************************************** STRUCTS ********************************************************
+	****************************************************************************************************************/
+	I_FREQ_TYPE envelopeOutput(const I_FREQ_TYPE time, Envelope& envelopeOutput, const I_FREQ_TYPE timeOn, const I_FREQ_TYPE timeOff) {
+		return envelopeOutput.amplitude(time, timeOn, timeOff);
+	}
+
+	// The envelope reads zero for the first few samples of its attack, so only a silent note past its attack is finished
+	bool envelopeFinished(const I_FREQ_TYPE amplitude, const I_FREQ_TYPE time, const VoiceEnvelope& envelope, const Note& n) {
+		return amplitude <= 0.0 && (time - n.on > envelope.attackEnd || n.off > n.on);
+	}
+
+	// FNV-1a
+	unsigned long long HashBytes(const void* data, size_t size, unsigned long long hash = 14695981039346656037ull) {
+		const unsigned char* bytes = (const unsigned char*)data;
+		for (size_t i = 0; i < size; i++)
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		return hash;
+	}
+
+	struct BaseInstrument {
+		I_FREQ_TYPE volume;
+		synthesizer::EnvelopeADSR envelopeOutput;
+		I_FREQ_TYPE maxLifeTme;
+		wstring name;
+		const PitchTable* tuning;
+		NoiseShape noise;
+
+		// Set by the parameter bank whenever it writes one of the fields above, see CachedParameterHash
+		bool parametersChanged;
+
+		BaseInstrument() {
+			tuning = &EQUAL_TEMPERAMENT;
+			parametersChanged = true;
+			m_parameterHash = 0;
+		}
+
+		virtual I_FREQ_TYPE sound(const I_FREQ_TYPE time, const synthesizer::Note& n, bool& noteFinished) = 0;
+
+		// The note at each of 'frames' times into 'samples'. Stops after the sample that finishes the note and
+		// returns how many samples it wrote. Instruments that can share work across a block override it.
+		virtual unsigned int RenderBlock(const synthesizer::Note& n, const I_FREQ_TYPE* times, const unsigned int frames,
+			I_FREQ_TYPE* samples, bool& noteFinished) {
+			for (unsigned int i = 0; i < frames; i++) {
+				samples[i] = sound(times[i], n, noteFinished);
+				if (noteFinished)
+					return i + 1;
+			}
+			return frames;
+		}
+
+		// Fills n.record at note on, before NoteStarted. sound() only reads it: every note it is given was prepared.
+		virtual void Prepare(synthesizer::Note& n) const {
+			n.record.Reset(envelopeOutput);
+		}
+
+		// Called under the voice lock when a note starts playing live and when it is done, for instruments that
+		// keep per-voice state outside the note
+		virtual void NoteStarted(synthesizer::Note& n) {}
+		virtual void NoteStopped(synthesizer::Note& n) {}
+
+		// Changes whenever a parameter that shapes the sound changes, so anything rendered ahead can tell it is stale
+		virtual unsigned long long ParameterHash() const {
+			I_FREQ_TYPE parameters[] = { volume, maxLifeTme, envelopeOutput.attackTime, envelopeOutput.decayTime,
+				envelopeOutput.sustainTime, envelopeOutput.releaseTime, envelopeOutput.startAmplitude };
+			I_FREQ_TYPE noiseShape[] = { (I_FREQ_TYPE)noise.color, noise.hertz, noise.q };
+			unsigned long long hash = HashBytes(parameters, sizeof(parameters));
+			hash = HashBytes(noiseShape, sizeof(noiseShape), hash);
+			return HashBytes(&tuning, sizeof(tuning), hash);
+		}
+
+		// ParameterHash as of the last parameter write, recomputed once per change instead of on every note.
+		// Call it under the engine's voice lock, which the audio thread holds while it writes parameters.
+		unsigned long long CachedParameterHash() {
+			if (parametersChanged) {
+				m_parameterHash = ParameterHash();
+				parametersChanged = false;
+			}
+			return m_parameterHash;
+		}
+
+	private:
+		unsigned long long m_parameterHash;
+	};
+
+	struct Bell : public BaseInstrument {
+		ModLfo vibrato;
+
+		Bell() : vibrato(5.0) {
+			envelopeOutput.attackTime = 0.01;
+			envelopeOutput.decayTime = 1.0;
+			envelopeOutput.sustainTime = 0.0;
+			envelopeOutput.releaseTime = 1.0;
+			maxLifeTme = 3.0;
+			volume = 1.0;
+			name = L"Bell";
+		}
+
+		virtual void Prepare(synthesizer::Note& n) const {
+			n.record.Reset(envelopeOutput);
+			n.record.AddLayer(synthesizer::Scale(n.id + 12, *tuning), 1.00);
+			n.record.AddLayer(synthesizer::Scale(n.id + 24, *tuning), 0.50);
+			n.record.AddLayer(synthesizer::Scale(n.id + 36, *tuning), 0.25);
+		}
+
+		virtual I_FREQ_TYPE sound(const I_FREQ_TYPE time, const synthesizer::Note& n, bool& noteFinished) {
+			const VoiceRecord& voice = n.record;
+			I_FREQ_TYPE lifeTime = time - n.on;
+
+			I_FREQ_TYPE amplitude = voice.envelope.amplitude(time, n.on, n.off);
+			if (synthesizer::envelopeFinished(amplitude, time, voice.envelope, n)) noteFinished = true;
+
+			I_FREQ_TYPE pitch = synthesizer::ModulationTarget(n, MOD_PITCH, time);
+			I_FREQ_TYPE sound =
+				voice.gain[0] * synthesizer::OscillateLayer(voice, 0, lifeTime, synthesizer::SINE_WAVE, 0.001 * synthesizer::LfoValue(vibrato, n, time) + pitch)
+				+ voice.gain[1] * synthesizer::OscillateLayer(voice, 1, lifeTime, synthesizer::SINE_WAVE, pitch)
+				+ voice.gain[2] * synthesizer::OscillateLayer(voice, 2, lifeTime, synthesizer::SINE_WAVE, pitch);
+
+			return amplitude * sound * volume;
+		}
+
+	};
+
+	struct Bell8 : public BaseInstrument {
+		ModLfo vibrato;
+
+		Bell8() : vibrato(5.0) {
+			envelopeOutput.attackTime = 0.01;
+			envelopeOutput.decayTime = 0.5;
+			envelopeOutput.sustainTime = 0.8;
+			envelopeOutput.releaseTime = 1.0;
+			maxLifeTme = 3.0;
+			volume = 1.0;
+			name = L"8-Bit Bell";
+		}
+
+		virtual void Prepare(synthesizer::Note& n) const {
+			n.record.Reset(envelopeOutput);
+			n.record.AddLayer(synthesizer::Scale(n.id, *tuning), 1.00);
+			n.record.AddLayer(synthesizer::Scale(n.id + 12, *tuning), 0.50);
+			n.record.AddLayer(synthesizer::Scale(n.id + 24, *tuning), 0.25);
+		}
+
+		virtual I_FREQ_TYPE sound(const I_FREQ_TYPE time, const synthesizer::Note& n, bool& noteFinished) {
+			const VoiceRecord& voice = n.record;
+			I_FREQ_TYPE lifeTime = time - n.on;
+
+			I_FREQ_TYPE amplitude = voice.envelope.amplitude(time, n.on, n.off);
+			if (synthesizer::envelopeFinished(amplitude, time, voice.envelope, n)) noteFinished = true;
+
+			I_FREQ_TYPE pitch = synthesizer::ModulationTarget(n, MOD_PITCH, time);
+			I_FREQ_TYPE sound =
+				voice.gain[0] * synthesizer::OscillateLayer(voice, 0, lifeTime, synthesizer::SQUARE_WAVE, 0.001 * synthesizer::LfoValue(vibrato, n, time) + pitch)
+				+ voice.gain[1] * synthesizer::OscillateLayer(voice, 1, lifeTime, synthesizer::SINE_WAVE, pitch)
+				+ voice.gain[2] * synthesizer::OscillateLayer(voice, 2, lifeTime, synthesizer::SINE_WAVE, pitch);
+
+			return amplitude * sound * volume;
+		}
+
+	};
+
+	struct Harmonica : public BaseInstrument {
+		ModLfo vibrato;
+
+		Harmonica() : vibrato(5.0) {
+			envelopeOutput.attackTime = 0.1;
+			envelopeOutput.decayTime = 1.0;
+			envelopeOutput.sustainTime = 0.95;
+			envelopeOutput.releaseTime = 0.1;
+			maxLifeTme = -1.0;
+			name = L"Harmonica";
+			noise.color = NOISE_COLOR_WHITE;
+			volume = 0.3;
+		}
+
+		virtual void Prepare(synthesizer::Note& n) const {
+			n.record.Reset(envelopeOutput);
+			n.record.AddLayer(synthesizer::Scale(n.id - 12, *tuning), 1.00);
+			n.record.AddLayer(synthesizer::Scale(n.id, *tuning), 1.00);
+			n.record.AddLayer(synthesizer::Scale(n.id + 12, *tuning), 0.50);
+		}
+
+		virtual I_FREQ_TYPE sound(const I_FREQ_TYPE time, const synthesizer::Note& n, bool& noteFinished) {
+			const VoiceRecord& voice = n.record;
+			I_FREQ_TYPE lifeTime = time - n.on;
+
+			I_FREQ_TYPE amplitude = voice.envelope.amplitude(time, n.on, n.off);
+			if (synthesizer::envelopeFinished(amplitude, time, voice.envelope, n)) noteFinished = true;
+
+			// One vibrato for both layers; the reversed layer runs it backwards, and the sine is odd
+			I_FREQ_TYPE vibratoPhase = 0.001 * synthesizer::LfoValue(vibrato, n, time);
+			I_FREQ_TYPE pitch = synthesizer::ModulationTarget(n, MOD_PITCH, time);
+			I_FREQ_TYPE sound =
+				voice.gain[0] * synthesizer::OscillateLayer(voice, 0, -lifeTime, synthesizer::SAW_WAVE, pitch - vibratoPhase, 100)
+				+ voice.gain[1] * synthesizer::OscillateLayer(voice, 1, lifeTime, synthesizer::SQUARE_WAVE, vibratoPhase + pitch)
+				+ voice.gain[2] * synthesizer::OscillateLayer(voice, 2, lifeTime, synthesizer::SQUARE_WAVE, pitch)
+				+ 0.05 * synthesizer::VoiceNoise(n, time);
+
+			return amplitude * sound * volume;
+		}
+
+	};
+
+	const int SUPERSAW_NOTES = 32; // notes with a unison stack of their own
+
+	// Unison stack of detuned saws over a falling sub octave and a saw an octave up, all band limited phase
+	// accumulators. Set 'unison' while setting up; detune and spread are parameters, read at every note on.
+	struct Supersaw : public BaseInstrument {
+		ModLfo vibrato;
+		UnisonSettings unison;
+
+		Supersaw() : vibrato(5.0) {
+			envelopeOutput.attackTime = 0.05;
+			envelopeOutput.decayTime = 1.0;
+			envelopeOutput.sustainTime = 0.95;
+			envelopeOutput.releaseTime = 0.1;
+			maxLifeTme = -1.0;
+			name = L"Supersaw";
+			noise.color = NOISE_COLOR_WHITE;
+			volume = 0.3;
+			fill(m_used, m_used + SUPERSAW_NOTES, false);
+			m_refused = 0;
+		}
+
+		virtual void Prepare(synthesizer::Note& n) const {
+			n.record.Reset(envelopeOutput);
+			n.record.AddLayer(synthesizer::Scale(n.id, *tuning), 1.00);
+		}
+
+		virtual void NoteStarted(synthesizer::Note& n) {
+			n.voice = -1;
+			for (int slot = 0; slot < SUPERSAW_NOTES; slot++)
+				if (!m_used[slot]) {
+					m_used[slot] = true;
+					StartStack(m_stacks[slot], n);
+					n.voice = slot;
+					return;
+				}
+
+			n.voice = VOICE_REFUSED;
+			m_refused++;
+		}
+
+		virtual void NoteStopped(synthesizer::Note& n) {
+			if (n.voice >= 0)
+				m_used[n.voice] = false;
+			n.voice = -1;
+		}
+
+		// Every note it is given was started: a note without a stack was refused and ends right away
+		virtual I_FREQ_TYPE sound(const I_FREQ_TYPE time, const synthesizer::Note& n, bool& noteFinished) {
+			const VoiceRecord& voice = n.record;
+			if (n.voice < 0) {
+				noteFinished = true;
+				return 0.0;
+			}
+
+			I_FREQ_TYPE amplitude = voice.envelope.amplitude(time, n.on, n.off);
+			if (synthesizer::envelopeFinished(amplitude, time, voice.envelope, n)) noteFinished = true;
+
+			I_FREQ_TYPE modulation = 0.001 * synthesizer::LfoValue(vibrato, n, time) + synthesizer::ModulationTarget(n, MOD_PITCH, time);
+			I_FREQ_TYPE left, right;
+			m_stacks[n.voice].Render(time, modulation, left, right);
+
+			// The engine mixes in mono, so the stereo spread folds back to the middle
+			I_FREQ_TYPE sound = (left + right) * sqrt(0.5)
+				+ 0.05 * synthesizer::VoiceNoise(n, time);
+
+			return amplitude * sound * volume;
+		}
+
+		// Notes refused because all SUPERSAW_NOTES stacks were taken
+		unsigned long long RefusedNotes() const {
+			return m_refused;
+		}
+
+	private:
+		void StartStack(UnisonOscillator& stack, const synthesizer::Note& n) {
+			stack.Start(n.record.hertz[0], n.on, unison);
+			stack.AddVoice(0.5, -1.0);
+			stack.AddVoice(2.0, 0.5);
+		}
+
+		UnisonOscillator m_stacks[SUPERSAW_NOTES];
+		bool m_used[SUPERSAW_NOTES];
+		atomic<unsigned long long> m_refused;
+	};
+
+
+	struct KickDrum : public BaseInstrument {
+		ModLfo sweep;
+		ModLfo subSweep;
+
+		KickDrum() : sweep(1.0), subSweep(2.0) {
+			envelopeOutput.attackTime = 0.01;
+			envelopeOutput.decayTime = 0.075;
+			envelopeOutput.sustainTime = 0.0;
+			envelopeOutput.releaseTime = 0.0;
+			maxLifeTme = 1.5;
+			name = L"Drum Kick";
+			noise.color = NOISE_COLOR_WHITE;
+			volume = 2.0;
+		}
+
+		virtual void Prepare(synthesizer::Note& n) const {
+			n.record.Reset(envelopeOutput);
+			n.record.AddLayer(synthesizer::Scale(n.id - 36, *tuning), 1.0);
+			n.record.AddLayer(synthesizer::Scale(n.id - 48, *tuning), 1.0);
+		}
+
+		virtual I_FREQ_TYPE sound(const I_FREQ_TYPE time, const synthesizer::Note& n, bool& noteFinished) {
+			const VoiceRecord& voice = n.record;
+			I_FREQ_TYPE lifeTime = time - n.on;
+
+			I_FREQ_TYPE amplitude = voice.envelope.amplitude(time, n.on, n.off);
+			if (maxLifeTme > 0.0 && lifeTime >= maxLifeTme)	noteFinished = true;
+
+			I_FREQ_TYPE pitch = synthesizer::ModulationTarget(n, MOD_PITCH, time);
+			I_FREQ_TYPE sound =
+				voice.gain[0] * synthesizer::OscillateLayer(voice, 0, lifeTime, synthesizer::SINE_WAVE, 1.0 * synthesizer::LfoValue(sweep, n, time) + pitch)
+				+ voice.gain[1] * synthesizer::OscillateLayer(voice, 1, lifeTime, synthesizer::SINE_WAVE, 2.0 * synthesizer::LfoValue(subSweep, n, time) + pitch)
+				+ 0.001 * synthesizer::VoiceNoise(n, time);
+
+			return amplitude * sound * volume;
+		}
+
+	};
+
+	struct SnareDrum : public BaseInstrument {
+		ModLfo sweep;
+
+		SnareDrum() : sweep(0.5) {
+			envelopeOutput.attackTime = 0.0;
+			envelopeOutput.decayTime = 0.125;
+			envelopeOutput.sustainTime = 0.0;
+			envelopeOutput.releaseTime = 0.0;
+			maxLifeTme = 0.25;
+			name = L"Drum Snare";
+			noise.color = NOISE_COLOR_WHITE;
+			volume = 1.0;
+		}
+
+		virtual void Prepare(synthesizer::Note& n) const {
+			n.record.Reset(envelopeOutput);
+			n.record.AddLayer(synthesizer::Scale(n.id, *tuning), 0.5);
+		}
+
+		virtual I_FREQ_TYPE sound(const I_FREQ_TYPE time, const synthesizer::Note& n, bool& noteFinished) {
+			const VoiceRecord& voice = n.record;
+			I_FREQ_TYPE lifeTime = time - n.on;
+
+			I_FREQ_TYPE amplitude = voice.envelope.amplitude(time, n.on, n.off);
+			if (maxLifeTme > 0.0 && lifeTime >= maxLifeTme)	noteFinished = true;
+
+			I_FREQ_TYPE pitch = synthesizer::ModulationTarget(n, MOD_PITCH, time);
+			I_FREQ_TYPE sound =
+				voice.gain[0] * synthesizer::OscillateLayer(voice, 0, lifeTime, synthesizer::SINE_WAVE, 1.0 * synthesizer::LfoValue(sweep, n, time) + pitch)
+				+ 0.1 * synthesizer::VoiceNoise(n, time);
+
+			return amplitude * sound * volume;
+		}
+
+	};
+
+
+	struct HiHat : public BaseInstrument {
+		ModLfo sweep;
+
+		HiHat() : sweep(1.5) {
+			envelopeOutput.attackTime = 0.01;
+			envelopeOutput.decayTime = 0.025;
+			envelopeOutput.sustainTime = 0.0;
+			envelopeOutput.releaseTime = 0.0;
+			maxLifeTme = 1.0;
+			name = L"Drum HiHat";
+			noise.color = NOISE_COLOR_WHITE;
+			volume = 0.25;
+		}
+
+		virtual void Prepare(synthesizer::Note& n) const {
+			n.record.Reset(envelopeOutput);
+			n.record.AddLayer(synthesizer::Scale(n.id - 12, *tuning), 0.1);
+		}
+
+		virtual I_FREQ_TYPE sound(const I_FREQ_TYPE time, const synthesizer::Note& n, bool& noteFinished) {
+			const VoiceRecord& voice = n.record;
+			I_FREQ_TYPE lifeTime = time - n.on;
+
+			I_FREQ_TYPE amplitude = voice.envelope.amplitude(time, n.on, n.off);
+			if (maxLifeTme > 0.0 && lifeTime >= maxLifeTme)	noteFinished = true;
+
+			I_FREQ_TYPE pitch = synthesizer::ModulationTarget(n, MOD_PITCH, time);
+			I_FREQ_TYPE sound =
+				voice.gain[0] * synthesizer::OscillateLayer(voice, 0, lifeTime, synthesizer::SQUARE_WAVE, 1.0 * synthesizer::LfoValue(sweep, n, time) + pitch)
+				+ 0.9 * synthesizer::VoiceNoise(n, time);
+
+			return amplitude * sound * volume;
+		}
+
+	};
+
+}
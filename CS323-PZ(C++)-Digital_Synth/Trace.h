@@ -0,0 +1,227 @@
+#pragma once
+
+#include <fstream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+using namespace std;
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	************************************************* TRACE ********************************************************
+	****************************************************************************************************************/
+
+	// Scoped trace points recorded into one ring per thread and written out as Chrome trace event JSON (open it in
+	// chrome://tracing or ui.perfetto.dev). While tracing is off a trace point costs one relaxed atomic load.
+	// Event names must be string literals, only the pointer is stored. A thread's ring is freed when the thread
+	// exits, with the events in it, so threads that come and go do not pile up rings.
+
+	const size_t TRACE_EVENTS = 16384; // per thread, the oldest events are overwritten
+
+	struct TraceEvent {
+		const char* name;
+		long long start;    // microseconds since the trace clock started
+		long long duration; // < 0 marks an instant event
+	};
+
+	// Written by its owner thread only. A dump reads it while it is being written, so the oldest slots may
+	// be torn; they are skipped.
+	struct TraceBuffer {
+		string threadName;
+		int threadId;
+		atomic<unsigned long long> head;
+		vector<TraceEvent> events;
+
+		TraceBuffer() : head(0), events(TRACE_EVENTS) {
+			threadId = 0;
+		}
+	};
+
+	static atomic<bool> traceEnabled(false);
+	static atomic<bool> traceDumpOnUnderrun(false);
+	static atomic<bool> traceDumpRequested(false);
+	static thread_local TraceBuffer* traceThreadBuffer = nullptr;
+	static atomic<int> traceThreadIds(0);
+
+	static mutex& TraceRegistryMutex() {
+		static mutex registryMutex;
+		return registryMutex;
+	}
+
+	static vector<unique_ptr<TraceBuffer>>& TraceRegistry() {
+		static vector<unique_ptr<TraceBuffer>> registry;
+		return registry;
+	}
+
+	static long long TraceNow() {
+		static const chrono::high_resolution_clock::time_point origin = chrono::high_resolution_clock::now();
+		return chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - origin).count();
+	}
+
+	void TraceEnable(bool enable, bool dumpOnUnderrun = false) {
+		TraceNow(); // start the clock outside any traced path
+		traceDumpOnUnderrun = dumpOnUnderrun;
+		traceEnabled.store(enable, memory_order_relaxed);
+	}
+
+	bool TraceEnabled() {
+		return traceEnabled.load(memory_order_relaxed);
+	}
+
+	// Creates a ring for a thread this program does not start, such as a driver callback, so it can be set up
+	// ahead from the thread that opens the driver. The callback then records with the TraceInstant overload
+	// that takes the ring, and never allocates or locks. Only one thread may record into a ring at a time.
+	TraceBuffer* TraceRegister(const string& name) {
+		unique_ptr<TraceBuffer> buffer(new TraceBuffer());
+		buffer->threadName = name;
+
+		buffer->threadId = ++traceThreadIds;
+
+		unique_lock<mutex> lm(TraceRegistryMutex());
+		TraceRegistry().push_back(move(buffer));
+		return TraceRegistry().back().get();
+	}
+
+	// Frees a ring from TraceRegister once nothing records into it any more
+	void TraceUnregister(TraceBuffer* buffer) {
+		unique_ptr<TraceBuffer> released;
+		unique_lock<mutex> lm(TraceRegistryMutex());
+		vector<unique_ptr<TraceBuffer>>& registry = TraceRegistry();
+		auto found = find_if(registry.begin(), registry.end(), [buffer](const unique_ptr<TraceBuffer>& item) { return item.get() == buffer; });
+		if (found == registry.end())
+			return;
+		released = move(*found);
+		registry.erase(found);
+	}
+
+	// Owns the calling thread's ring and releases it when the thread exits. Trace points read the plain
+	// traceThreadBuffer pointer, which needs no construction check.
+	struct TraceThreadRing {
+		TraceBuffer* buffer;
+
+		TraceThreadRing() {
+			buffer = nullptr;
+		}
+
+		~TraceThreadRing() {
+			traceThreadBuffer = nullptr;
+			if (buffer != nullptr)
+				TraceUnregister(buffer);
+		}
+	};
+
+	static thread_local TraceThreadRing traceThreadRing;
+
+	// Gives the calling thread its ring. Call it at the start of every thread that records, before any
+	// allocation free section: events from threads without a ring are dropped.
+	void TraceThread(const string& name) {
+		if (traceThreadBuffer != nullptr)
+			return;
+		traceThreadRing.buffer = TraceRegister(name);
+		traceThreadBuffer = traceThreadRing.buffer;
+	}
+
+	static void TraceRecord(TraceBuffer* buffer, const char* name, long long start, long long duration) {
+		if (buffer == nullptr)
+			return;
+
+		unsigned long long head = buffer->head.load(memory_order_relaxed);
+		TraceEvent& e = buffer->events[head % TRACE_EVENTS];
+		e.name = name;
+		e.start = start;
+		e.duration = duration;
+		buffer->head.store(head + 1, memory_order_release);
+	}
+
+	static void TraceRecord(const char* name, long long start, long long duration) {
+		TraceRecord(traceThreadBuffer, name, start, duration);
+	}
+
+	struct TraceScope {
+		const char* name;
+		long long start;
+
+		TraceScope(const char* scopeName) {
+			name = scopeName;
+			start = TraceEnabled() ? TraceNow() : -1;
+		}
+
+		~TraceScope() {
+			End();
+		}
+
+		// Records the scope now rather than at the end of the enclosing block
+		void End() {
+			if (start >= 0)
+				TraceRecord(name, start, TraceNow() - start);
+			start = -1;
+		}
+	};
+
+	void TraceInstant(const char* name) {
+		if (TraceEnabled())
+			TraceRecord(name, TraceNow(), -1);
+	}
+
+	// Into a ring from TraceRegister rather than the calling thread's own
+	void TraceInstant(TraceBuffer* buffer, const char* name) {
+		if (TraceEnabled())
+			TraceRecord(buffer, name, TraceNow(), -1);
+	}
+
+	// Safe from any thread, including the render thread: it only raises a flag for the thread that writes files
+	void RequestTraceDump() {
+		traceDumpRequested = true;
+	}
+
+	bool TraceDumpRequested() {
+		return traceDumpRequested.exchange(false);
+	}
+
+	// Marks a starved device and, when asked for in TraceEnable, requests a dump
+	void TraceUnderrun() {
+		if (!TraceEnabled())
+			return;
+		TraceRecord("underrun", TraceNow(), -1);
+		if (traceDumpOnUnderrun)
+			RequestTraceDump();
+	}
+
+	// Writes every thread's ring as trace event JSON
+	bool WriteTrace(const string& path) {
+		ofstream file(path);
+		if (!file.is_open())
+			return false;
+
+		file << "{\"traceEvents\":[";
+		bool first = true;
+
+		unique_lock<mutex> lm(TraceRegistryMutex());
+		for (auto& buffer : TraceRegistry()) {
+			file << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId
+				<< ",\"args\":{\"name\":\"" << buffer->threadName << "\"}}";
+			first = false;
+
+			// Skip a margin at the old end, those slots may be overwritten while we read
+			unsigned long long head = buffer->head.load(memory_order_acquire);
+			unsigned long long begin = head > TRACE_EVENTS ? head - TRACE_EVENTS + 64 : 0;
+
+			for (unsigned long long i = begin; i < head; i++) {
+				const TraceEvent& e = buffer->events[i % TRACE_EVENTS];
+				file << ",\n{\"name\":\"" << e.name << "\",\"pid\":1,\"tid\":" << buffer->threadId << ",\"ts\":" << e.start;
+				if (e.duration >= 0)
+					file << ",\"ph\":\"X\",\"dur\":" << e.duration << "}";
+				else
+					file << ",\"ph\":\"i\",\"s\":\"t\"}";
+			}
+		}
+
+		file << "\n]}\n";
+		return file.good();
+	}
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+using namespace std;
+
+#include "OscilatorThread.h"
+
+namespace synthesizer {
+
+	/***************************************************************************************************************
+	************************************************ UNISON ********************************************************
+	****************************************************************************************************************/
+
+	// A stack of detuned saws rendered together. Each saw is a phase accumulator with a PolyBLEP correction at the
+	// wrap, so a voice costs a few multiply-adds instead of one sin per harmonic. The voices live in parallel
+	// arrays and the inner loop has no branches the compiler cannot turn into selects, so it vectorizes.
+
+	const int UNISON_MAX_VOICES = 18; // 16 detuned plus room for the supporting layers of an instrument
+
+	struct UnisonSettings {
+		int voices;
+		I_FREQ_TYPE detune;       // cents between the lowest and the highest voice
+		I_FREQ_TYPE stereoSpread; // 0 keeps every voice in the middle, 1 spreads them hard left to right
+		I_FREQ_TYPE gain;         // of the whole stack, divided over the voices by power
+
+		UnisonSettings() {
+			voices = 7;
+			detune = 30.0;
+			stereoSpread = 0.5;
+			gain = 1.0;
+		}
+	};
+
+	// Smooths the step a naive saw takes at the wrap, add it to a falling saw. t is the phase in cycles, dt the
+	// phase step per sample.
+	inline I_FREQ_TYPE PolyBlep(I_FREQ_TYPE t, I_FREQ_TYPE dt) {
+		I_FREQ_TYPE after = t / dt;
+		I_FREQ_TYPE before = (t - 1.0) / dt;
+		return (t < dt ? after + after - after * after - 1.0 : 0.0)
+			+ (t > 1.0 - dt ? before * before + before + before + 1.0 : 0.0);
+	}
+
+	class UnisonOscillator {
+
+	public:
+		UnisonOscillator() {
+			m_count = 0;
+			m_hertz = 0.0;
+			m_time = 0.0;
+		}
+
+		// Restarts the stack for a note of 'hertz' starting at 'time'
+		void Start(I_FREQ_TYPE hertz, I_FREQ_TYPE time, const UnisonSettings& settings) {
+			m_count = 0;
+			m_hertz = hertz;
+			m_time = time;
+
+			int voices = max(1, min(settings.voices, UNISON_MAX_VOICES));
+			I_FREQ_TYPE gain = settings.gain / sqrt((I_FREQ_TYPE)voices);
+			for (int v = 0; v < voices; v++) {
+				I_FREQ_TYPE position = voices > 1 ? (I_FREQ_TYPE)v / (voices - 1) - 0.5 : 0.0; // -0.5 .. 0.5
+				// Neighbours in pitch go to opposite sides, so neither side gets all the sharp or all the flat voices
+				I_FREQ_TYPE pan = settings.stereoSpread * (v % 2 == 0 ? position : -position);
+				// Spread the start phases so the stack does not open with every saw wrapping at once
+				AddVoice(pow(2.0, settings.detune * position / 1200.0), gain, pan, fmod(0.6180339887498949 * v, 1.0));
+			}
+		}
+
+		// An extra saw at 'ratio' times the note, starting at 'phase' cycles. The saws fall like SAW_WAVE, a
+		// negative gain gives a rising one.
+		void AddVoice(I_FREQ_TYPE ratio, I_FREQ_TYPE gain, I_FREQ_TYPE pan = 0.0, I_FREQ_TYPE phase = 0.0) {
+			if (m_count >= UNISON_MAX_VOICES)
+				return;
+
+			// Equal power pan, -1 left to 1 right
+			I_FREQ_TYPE angle = (max(-1.0, min(pan, 1.0)) + 1.0) * PI / 4.0;
+			m_ratio[m_count] = ratio;
+			m_left[m_count] = gain * cos(angle);
+			m_right[m_count] = gain * sin(angle);
+			m_phase[m_count] = phase;
+			m_count++;
+		}
+
+		// Advances to 'time' and returns both channels. 'modulation' is a phase offset in the units of
+		// OscillateModulated, so vibrato routed to the stack sounds as it does on the other layers.
+		void Render(I_FREQ_TYPE time, I_FREQ_TYPE modulation, I_FREQ_TYPE& left, I_FREQ_TYPE& right) {
+			I_FREQ_TYPE elapsed = max(0.0, time - m_time);
+			m_time = time;
+
+			I_FREQ_TYPE step = m_hertz * elapsed;
+			I_FREQ_TYPE offset = modulation * m_hertz / (2.0 * PI);
+			I_FREQ_TYPE sumLeft = 0.0;
+			I_FREQ_TYPE sumRight = 0.0;
+
+			for (int v = 0; v < m_count; v++) {
+				I_FREQ_TYPE dt = max(step * m_ratio[v], 1e-9);
+				I_FREQ_TYPE phase = m_phase[v] + dt;
+				phase -= floor(phase);
+				m_phase[v] = phase;
+
+				I_FREQ_TYPE t = phase + offset * m_ratio[v];
+				t -= floor(t);
+				I_FREQ_TYPE saw = 1.0 - 2.0 * t + PolyBlep(t, dt);
+
+				sumLeft += saw * m_left[v];
+				sumRight += saw * m_right[v];
+			}
+
+			left = sumLeft;
+			right = sumRight;
+		}
+
+		int Voices() const { return m_count; }
+
+	private:
+		int m_count;
+		I_FREQ_TYPE m_hertz;
+		I_FREQ_TYPE m_time;
+		I_FREQ_TYPE m_phase[UNISON_MAX_VOICES];
+		I_FREQ_TYPE m_ratio[UNISON_MAX_VOICES];
+		I_FREQ_TYPE m_left[UNISON_MAX_VOICES];
+		I_FREQ_TYPE m_right[UNISON_MAX_VOICES];
+	};
+}